@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright (C) 2026 virtualgrub39
+
+/* Tokenizes the same input with every scanner implementation available on this CPU, reports the throughput of
+ * each, and checks that all of them produce the token stream of the scalar implementation.
+ *
+ * usage: bench-lexer [file.mml] [iterations]
+ * Without a file, 64 MiB of whitespace-, comment- and number-heavy MML is generated in memory. */
+
+#define _DEFAULT_SOURCE
+
+#include "../source/mml2midi.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double
+now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static char *
+generate (size_t size)
+{
+    static const char *const pieces[] = {
+        "c4 d8. e16 ",
+        "        \t\t        ",
+        "% a rather long comment line, the way generated scores annotate every bar of the piece\n",
+        "l1234567890123 ",
+        "@drum_pattern_with_a_long_name ",
+        "!chord_ab_cd_ef_gh { (c e g)2 } ",
+        "[ c d e : f g ]16\n\n\n    ",
+    };
+
+    char *bytes = malloc (size);
+    size_t n = 0;
+    unsigned seed = 1;
+
+    while (n < size)
+    {
+        seed = seed * 1103515245 + 12345;
+        const char *piece = pieces[(seed >> 16) % (sizeof pieces / sizeof *pieces)];
+        size_t len = strlen (piece);
+        if (n + len > size) len = size - n;
+        memcpy (bytes + n, piece, len);
+        n += len;
+    }
+
+    return bytes;
+}
+
+int
+main (int argc, char *argv[])
+{
+    int iterations = argc > 2 ? atoi (argv[2]) : 5;
+    mml_source src = { 0 };
+    char *generated = NULL;
+    const char *data;
+    size_t size;
+
+    if (argc > 1)
+    {
+        if (mml_source_open (&src, argv[1], 0) != 0) return 1;
+        data = src.data;
+        size = src.size;
+    }
+    else
+    {
+        size = (size_t)64 << 20;
+        data = generated = generate (size);
+    }
+
+    mml_scan_select (MML_SCAN_SCALAR);
+    mml_token_stream reference;
+    if (mml_tokenize (data, size, &reference) != 0) return 1;
+    size_t ntokens = reference.size;
+
+    printf ("input: %zu bytes, %zu tokens, %d iterations\n", size, ntokens, iterations);
+
+    static const mml_scan_impl impls[] = { MML_SCAN_SCALAR, MML_SCAN_SSE2, MML_SCAN_AVX2 };
+    int status = 0;
+
+    for (size_t i = 0; i < sizeof impls / sizeof *impls; ++i)
+    {
+        if (mml_scan_select (impls[i]) != 0) continue;
+
+        /* timed through the pull API, so only the lexer itself is measured */
+        double best = 1e30;
+        for (int it = 0; it < iterations; ++it)
+        {
+            mml_lexer lexer;
+            if (mml_lexer_init (&lexer, data, size) != 0) return 1;
+
+            double start = now ();
+            while (mml_read_next_token (&lexer).kind != MML_EOF);
+            double elapsed = now () - start;
+            if (elapsed < best) best = elapsed;
+        }
+
+        mml_token_stream tokens;
+        if (mml_tokenize (data, size, &tokens) != 0) return 1;
+        bool same = tokens.size == ntokens && memcmp (tokens.kinds, reference.kinds, ntokens) == 0
+                    && memcmp (tokens.offsets, reference.offsets, ntokens * sizeof *tokens.offsets) == 0
+                    && memcmp (tokens.lengths, reference.lengths, ntokens * sizeof *tokens.lengths) == 0
+                    && memcmp (tokens.values, reference.values, ntokens * sizeof *tokens.values) == 0;
+
+        printf ("%-8s %8.3f GB/s  %8.1f Mtokens/s  %s\n", mml_scan_name (), size / best / 1e9, ntokens / best / 1e6,
+                same ? "tokens match" : "TOKEN MISMATCH");
+        if (!same) status = 1;
+
+        mml_token_stream_free (&tokens);
+    }
+
+    mml_token_stream_free (&reference);
+    free (generated);
+    mml_source_close (&src);
+    return status;
+}
@@ -0,0 +1,83 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright (C) 2026 virtualgrub39
+
+/* Parses scores with many macro definitions and many more expansions, to show how macro lookup scales with the
+ * size of the macro table.
+ *
+ * usage: bench-macros [macros] [expansions]
+ * Defaults to 10000 macros and 100000 expansions; smaller tables are measured first, for comparison. */
+
+#define _DEFAULT_SOURCE
+
+#include "../source/mml2midi.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double
+now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static char *
+generate (size_t nmacros, size_t nexpansions, size_t *out_size)
+{
+    size_t capacity = nmacros * 48 + nexpansions * 24 + 16;
+    char *source = malloc (capacity);
+    size_t n = 0;
+    unsigned seed = 1;
+
+    for (size_t i = 0; i < nmacros; ++i)
+        n += snprintf (source + n, capacity - n, "!drum_pattern_%zu { c16 d16 }\n", i);
+
+    for (size_t i = 0; i < nexpansions; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        n += snprintf (source + n, capacity - n, "@drum_pattern_%u ", (unsigned)((seed >> 8) % nmacros));
+    }
+
+    n += snprintf (source + n, capacity - n, ";");
+
+    *out_size = n;
+    return source;
+}
+
+static int
+run (size_t nmacros, size_t nexpansions)
+{
+    size_t size;
+    char *source = generate (nmacros, nexpansions, &size);
+
+    mml_lexer lexer;
+    if (mml_lexer_init (&lexer, source, size) != 0) return 1;
+
+    mml_song song = { 0 };
+    double start = now ();
+    if (mml_parse (&lexer, &song) != 0) return 1;
+    double elapsed = now () - start;
+
+    printf ("%8zu macros %9zu expansions  %10.3f ms  %8.1f ns/expansion  (%zu events, %zu blocks, %.1f MiB)\n",
+            nmacros, nexpansions, elapsed * 1e3, elapsed * 1e9 / nexpansions, song.events.size + song.bodies.size,
+            song.arena.blocks, song.arena.reserved / (1024.0 * 1024.0));
+
+    mml_song_free (&song);
+    free (source);
+    return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+    size_t nmacros = argc > 1 ? strtoul (argv[1], NULL, 10) : 10000;
+    size_t nexpansions = argc > 2 ? strtoul (argv[2], NULL, 10) : 100000;
+
+    for (size_t n = nmacros / 10; n > 0 && n < nmacros; n *= 2)
+        if (run (n, nexpansions) != 0) return 1;
+
+    return run (nmacros, nexpansions);
+}
@@ -0,0 +1,128 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright (C) 2026 virtualgrub39
+
+/* Compares the input paths of the reader:
+ *   fread   - mml_read_all (fopen/fseek/ftell/malloc/fread)
+ *   mmap    - mml_source_open on a regular file
+ *   stream  - mml_source_open with MML_SOURCE_NOMAP (the stdin/pipe reader)
+ * Every byte is touched after reading, so the page faults of the mapped path are paid for as well.
+ *
+ * usage: bench-reader [file.mml] [iterations]
+ * Without a file, a temporary one of 256 MiB is generated. */
+
+#define _DEFAULT_SOURCE
+
+#include "../source/mml2midi.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double
+now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t
+touch (const char *data, size_t size)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < size; ++i) sum += (unsigned char)data[i];
+    return sum;
+}
+
+static void
+report (const char *name, size_t bytes, double seconds, int iterations)
+{
+    printf ("%-8s %10.1f MB/s  (%.3f ms/iter)\n", name, (double)bytes * iterations / seconds / 1e6,
+            seconds * 1e3 / iterations);
+}
+
+static const char *
+generate (size_t size)
+{
+    static char path[] = "/tmp/bench-reader-XXXXXX";
+    int fd = mkstemp (path);
+    if (fd < 0) return NULL;
+
+    static const char pattern[] = "t120 v72 l8 o5 [ c d e f g a b > c < : (c e g)4. r8 ]4 % comment\n";
+    char block[64 * 1024];
+    for (size_t i = 0; i < sizeof block; ++i) block[i] = pattern[i % (sizeof pattern - 1)];
+
+    for (size_t written = 0; written < size;)
+    {
+        size_t n = size - written < sizeof block ? size - written : sizeof block;
+        if (write (fd, block, n) != (ssize_t)n)
+        {
+            close (fd);
+            return NULL;
+        }
+        written += n;
+    }
+
+    close (fd);
+    return path;
+}
+
+int
+main (int argc, char *argv[])
+{
+    const char *path = argc > 1 ? argv[1] : NULL;
+    int iterations = argc > 2 ? atoi (argv[2]) : 5;
+    bool generated = path == NULL;
+
+    if (generated && !(path = generate ((size_t)256 << 20)))
+    {
+        perror ("bench-reader: failed to generate input");
+        return 1;
+    }
+
+    mml_source probe;
+    if (mml_source_open (&probe, path, 0) != 0) return 1;
+    size_t size = probe.size;
+    uint64_t expected = touch (probe.data, probe.size);
+    mml_source_close (&probe);
+
+    printf ("input: %s (%zu bytes), %d iterations\n", path, size, iterations);
+
+    double start = now ();
+    for (int i = 0; i < iterations; ++i)
+    {
+        char *bytes = mml_read_all (path);
+        if (!bytes || touch (bytes, size) != expected) return 1;
+        free (bytes);
+    }
+    report ("fread", size, now () - start, iterations);
+
+    static const struct
+    {
+        const char *name;
+        unsigned flags;
+    } modes[] = {
+        { "mmap", 0 },
+        { "mmap+hp", MML_SOURCE_HUGEPAGES },
+        { "stream", MML_SOURCE_NOMAP },
+    };
+
+    for (size_t m = 0; m < sizeof modes / sizeof *modes; ++m)
+    {
+        start = now ();
+        for (int i = 0; i < iterations; ++i)
+        {
+            mml_source src;
+            if (mml_source_open (&src, path, modes[m].flags) != 0) return 1;
+            if (src.size != size || touch (src.data, src.size) != expected) return 1;
+            mml_source_close (&src);
+        }
+        report (modes[m].name, size, now () - start, iterations);
+    }
+
+    if (generated) unlink (path);
+    return 0;
+}
@@ -0,0 +1,499 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright (C) 2026 virtualgrub39
+
+/* End-to-end benchmark on generated scores. Each scenario stresses one feature of the language; every stage of
+ * the pipeline is timed on its own:
+ *   read      mml_read_all                      input MB/s
+ *   tokenize  mml_tokenize                      input MB/s, tokens/s
+ *   parse     mml_lexer_init + mml_parse        input MB/s, events/s (parsed events)
+ *   write     mml_write_midi                    SMF MB/s, events/s (MIDI events written)
+ * Scenarios run in a child process each, so the reported peak RSS is that of the scenario alone.
+ *
+ * usage: bench-suite [--json] [--scale N] [--iterations N] [--threads N] [--only scenario] [--emit scenario]
+ * --scale multiplies the size of every score (1 = about 4 MB each), --threads is passed to mml_write_midi, and
+ * --emit writes the score of one scenario to stdout instead of measuring anything.
+ * The generator is deterministic: the same scale always yields the same bytes, so JSON reports of different
+ * builds can be compared directly. */
+
+#define _DEFAULT_SOURCE
+
+#include "../source/mml2midi.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static double
+now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* generator */
+
+typedef struct
+{
+    char *items;
+    size_t size, capacity;
+    unsigned seed;
+} score;
+
+__attribute__ ((format (printf, 2, 3))) static void
+emit (score *s, const char *format, ...)
+{
+    va_list args;
+    for (;;)
+    {
+        va_start (args, format);
+        int n = vsnprintf (s->items + s->size, s->capacity - s->size, format, args);
+        va_end (args);
+
+        if ((size_t)n < s->capacity - s->size)
+        {
+            s->size += n;
+            return;
+        }
+        da_reserve (NULL, s, s->size + n + 1);
+    }
+}
+
+static unsigned
+roll (score *s, unsigned n)
+{
+    s->seed = s->seed * 1103515245 + 12345;
+    return (s->seed >> 16) % n;
+}
+
+static void
+emit_note (score *s)
+{
+    static const char *const accidentals[] = { "", "", "", "+", "-" };
+    static const char *const lengths[] = { "", "", "4", "8", "8", "16", "16", "2", "32" };
+    static const char *const dots[] = { "", "", "", "", ".", ".." };
+
+    emit (s, "%c%s%s%s%s ", "cdefgabr"[roll (s, 8)], accidentals[roll (s, 5)], lengths[roll (s, 9)],
+          dots[roll (s, 6)], roll (s, 12) == 0 ? "&" : "");
+}
+
+static void
+emit_chord (score *s)
+{
+    emit (s, "(");
+    for (unsigned i = 0, n = 2 + roll (s, 5); i < n; ++i)
+        emit (s, "%c%s ", "cdefgab"[roll (s, 7)], roll (s, 4) ? "" : "+");
+    emit (s, ")%u ", 1u << roll (s, 5));
+}
+
+static void
+emit_command (score *s)
+{
+    switch (roll (s, 6))
+    {
+    case 0: emit (s, "t%u ", 60 + roll (s, 120)); break;
+    case 1: emit (s, "v%u ", 40 + roll (s, 80)); break;
+    case 2: emit (s, "l%u ", 1u << roll (s, 5)); break;
+    case 3: emit (s, "o%u ", 3 + roll (s, 3)); break;
+    case 4: emit (s, "> "); break;
+    default: emit (s, "< "); break;
+    }
+}
+
+/* nests up to `depth` loops, with 2 or 3 passes each and an occasional break section */
+static void
+emit_loop (score *s, unsigned depth)
+{
+    emit (s, "[ ");
+    for (unsigned i = 0, n = 2 + roll (s, 4); i < n; ++i)
+    {
+        if (depth > 1 && roll (s, 5) == 0)
+            emit_loop (s, depth - 1);
+        else
+            emit_note (s);
+    }
+    if (roll (s, 3) == 0)
+    {
+        emit (s, ": ");
+        emit_note (s);
+    }
+    emit (s, "]%u ", 2 + roll (s, 2));
+}
+
+static void
+emit_comment (score *s)
+{
+    static const char *const comments[] = {
+        "% bar",
+        "% ---- second theme, strings take over the melody from the woodwinds ----",
+        "% TODO: revisit the voicing here, the inner parts are muddy below the staff",
+    };
+    emit (s, "%s\n%*s", comments[roll (s, 3)], (int)roll (s, 24), "");
+}
+
+typedef enum
+{
+    SCENARIO_TRACKS,   /* 16 tracks of plain notes and commands */
+    SCENARIO_CHORDS,   /* dense chords */
+    SCENARIO_LOOPS,    /* loops nested up to 6 deep */
+    SCENARIO_MACROS,   /* thousands of definitions, tracks made mostly of expansions */
+    SCENARIO_COMMENTS, /* more comments and whitespace than music */
+    SCENARIO_MIXED,    /* all of the above */
+    SCENARIO_COUNT,
+} scenario;
+
+static const char *const scenario_names[SCENARIO_COUNT] = {
+    "tracks", "chords", "loops", "macros", "comments", "mixed",
+};
+
+#define SCORE_BYTES ((size_t)4 << 20) /* at scale 1 */
+#define NTRACKS 16
+#define NMACROS 4000
+
+static void
+generate (score *s, scenario which, unsigned scale)
+{
+    size_t per_track = SCORE_BYTES * scale / NTRACKS;
+    s->seed = 1 + which;
+
+    if (which == SCENARIO_MACROS || which == SCENARIO_MIXED)
+    {
+        for (unsigned m = 0; m < NMACROS; ++m)
+        {
+            emit (s, "!motif_%u { ", m);
+            for (unsigned i = 0, n = 2 + roll (s, 6); i < n; ++i)
+            {
+                unsigned what = roll (s, 8);
+                if (what == 0 && m > 0)
+                    emit (s, "@motif_%u ", roll (s, m)); /* only earlier ones: definitions are read in order */
+                else if (what == 1)
+                    emit_chord (s);
+                else
+                    emit_note (s);
+            }
+            emit (s, "}\n");
+        }
+    }
+
+    for (unsigned track = 0; track < NTRACKS; ++track)
+    {
+        size_t end = s->size + per_track;
+        emit (s, "t%u v%u o%u l8\n", 90 + track * 5, 60 + track * 4, 3 + track % 3);
+
+        while (s->size < end)
+        {
+            unsigned what = roll (s, 16);
+            switch (which)
+            {
+            case SCENARIO_TRACKS:
+                if (what == 0)
+                    emit_command (s);
+                else
+                    emit_note (s);
+                break;
+            case SCENARIO_CHORDS:
+                if (what < 12)
+                    emit_chord (s);
+                else
+                    emit_note (s);
+                break;
+            case SCENARIO_LOOPS:
+                if (what == 0)
+                    emit_loop (s, 6);
+                else
+                    emit_note (s);
+                break;
+            case SCENARIO_MACROS:
+                if (what < 12)
+                    emit (s, "@motif_%u ", roll (s, NMACROS));
+                else
+                    emit_note (s);
+                break;
+            case SCENARIO_COMMENTS:
+                if (what < 10)
+                    emit_comment (s);
+                else
+                    emit_note (s);
+                break;
+            default:
+                if (what < 5)
+                    emit_note (s);
+                else if (what < 8)
+                    emit_chord (s);
+                else if (what < 9)
+                    emit_loop (s, 4);
+                else if (what < 12)
+                    emit (s, "@motif_%u ", roll (s, NMACROS));
+                else if (what < 14)
+                    emit_comment (s);
+                else
+                    emit_command (s);
+                break;
+            }
+            if (roll (s, 24) == 0) emit (s, "\n");
+        }
+
+        emit (s, ";\n");
+    }
+}
+
+/* counts the events of a format 1 SMF, without trusting it */
+static size_t
+count_midi_events (const uint8_t *smf, size_t size)
+{
+    size_t events = 0;
+    size_t at = 14;
+
+    while (at + 8 <= size)
+    {
+        size_t len = (size_t)smf[at + 4] << 24 | smf[at + 5] << 16 | smf[at + 6] << 8 | smf[at + 7];
+        size_t i = at + 8, end = at + 8 + len;
+        if (end > size) break;
+        uint8_t running = 0;
+
+        while (i < end)
+        {
+            while (i < end && smf[i++] & 0x80); /* delta */
+            if (i >= end) break;
+
+            uint8_t status = smf[i] & 0x80 ? smf[i++] : running;
+            size_t skip;
+            if (status == 0xFF || status == 0xF0 || status == 0xF7)
+            {
+                if (status == 0xFF) i++; /* meta type */
+                size_t vlen = 0;
+                while (i < end && smf[i] & 0x80) vlen = vlen << 7 | (smf[i++] & 0x7F);
+                if (i < end) vlen = vlen << 7 | smf[i++];
+                skip = vlen;
+            }
+            else
+            {
+                running = status;
+                skip = (status >> 4) == 0xC || (status >> 4) == 0xD ? 1 : 2;
+            }
+
+            i += skip;
+            events++;
+        }
+
+        at = end;
+    }
+
+    return events;
+}
+
+/* harness */
+
+typedef struct
+{
+    double seconds;
+    size_t bytes, items; /* what the stage consumed or produced, for the rates */
+} stage;
+
+enum
+{
+    STAGE_READ,
+    STAGE_TOKENIZE,
+    STAGE_PARSE,
+    STAGE_WRITE,
+    STAGE_COUNT,
+};
+
+static const char *const stage_names[STAGE_COUNT] = { "read", "tokenize", "parse", "write" };
+static const char *const stage_units[STAGE_COUNT] = { NULL, "tokens", "events", "events" };
+
+typedef struct
+{
+    bool json;
+    unsigned scale, iterations, threads;
+} options;
+
+static int
+run (scenario which, const options *opt, bool first)
+{
+    score s = { 0 };
+    generate (&s, which, opt->scale);
+
+    char in_path[] = "/tmp/bench-suite-XXXXXX";
+    char out_path[] = "/tmp/bench-suite-XXXXXX";
+    int in_fd = mkstemp (in_path), out_fd = mkstemp (out_path);
+    if (in_fd < 0 || out_fd < 0 || write (in_fd, s.items, s.size) != (ssize_t)s.size) return 1;
+    close (in_fd);
+    close (out_fd);
+
+    stage stages[STAGE_COUNT];
+    for (int i = 0; i < STAGE_COUNT; ++i) stages[i] = (stage){ .seconds = 1e30, .bytes = s.size };
+
+    for (unsigned it = 0; it < opt->iterations; ++it)
+    {
+        double start = now ();
+        char *text = mml_read_all (in_path);
+        double elapsed = now () - start;
+        if (!text) return 1;
+        free (text);
+        if (elapsed < stages[STAGE_READ].seconds) stages[STAGE_READ].seconds = elapsed;
+
+        mml_token_stream tokens;
+        start = now ();
+        if (mml_tokenize (s.items, s.size, &tokens) != 0) return 1;
+        elapsed = now () - start;
+        stages[STAGE_TOKENIZE].items = tokens.size;
+        mml_token_stream_free (&tokens);
+        if (elapsed < stages[STAGE_TOKENIZE].seconds) stages[STAGE_TOKENIZE].seconds = elapsed;
+
+        mml_lexer lexer;
+        mml_song song = { 0 };
+        start = now ();
+        if (mml_lexer_init (&lexer, s.items, s.size) != 0 || mml_parse (&lexer, &song) != 0) return 1;
+        elapsed = now () - start;
+        stages[STAGE_PARSE].items = song.events.size + song.bodies.size;
+        if (elapsed < stages[STAGE_PARSE].seconds) stages[STAGE_PARSE].seconds = elapsed;
+
+        start = now ();
+        if (mml_write_midi (&song, out_path, opt->threads) != 0) return 1;
+        elapsed = now () - start;
+        if (elapsed < stages[STAGE_WRITE].seconds) stages[STAGE_WRITE].seconds = elapsed;
+
+        mml_song_free (&song);
+    }
+
+    char *smf = mml_read_all (out_path);
+    FILE *f = fopen (out_path, "rb");
+    fseek (f, 0, SEEK_END);
+    stages[STAGE_WRITE].bytes = ftell (f);
+    fclose (f);
+    stages[STAGE_WRITE].items = count_midi_events ((const uint8_t *)smf, stages[STAGE_WRITE].bytes);
+    free (smf);
+
+    unlink (in_path);
+    unlink (out_path);
+    free (s.items);
+
+    struct rusage usage;
+    getrusage (RUSAGE_SELF, &usage);
+
+    if (opt->json)
+    {
+        printf ("%s    {\"scenario\": \"%s\", \"input_bytes\": %zu, \"peak_rss_kb\": %ld, \"stages\": {",
+                first ? "" : ",\n", scenario_names[which], stages[STAGE_READ].bytes, usage.ru_maxrss);
+        for (int i = 0; i < STAGE_COUNT; ++i)
+        {
+            const stage *st = &stages[i];
+            printf ("%s\n        \"%s\": {\"seconds\": %.6f, \"bytes\": %zu, \"mb_per_s\": %.3f", i ? "," : "",
+                    stage_names[i], st->seconds, st->bytes, st->bytes / st->seconds / 1e6);
+            if (stage_units[i])
+                printf (", \"%s\": %zu, \"%s_per_s\": %.1f", stage_units[i], st->items, stage_units[i],
+                        st->items / st->seconds);
+            printf ("}");
+        }
+        printf ("}}");
+    }
+    else
+    {
+        printf ("%-9s %7.2f MB  peak RSS %7.1f MB\n", scenario_names[which], stages[STAGE_READ].bytes / 1e6,
+                usage.ru_maxrss / 1024.0);
+        for (int i = 0; i < STAGE_COUNT; ++i)
+        {
+            const stage *st = &stages[i];
+            printf ("  %-9s %9.3f ms %9.1f MB/s", stage_names[i], st->seconds * 1e3, st->bytes / st->seconds / 1e6);
+            if (stage_units[i]) printf ("  %9.2f M%s/s", st->items / st->seconds / 1e6, stage_units[i]);
+            printf ("\n");
+        }
+    }
+
+    return 0;
+}
+
+static int
+find_scenario (const char *name)
+{
+    for (int i = 0; i < SCENARIO_COUNT; ++i)
+        if (strcmp (name, scenario_names[i]) == 0) return i;
+
+    fprintf (stderr, "bench-suite: unknown scenario `%s`\n", name);
+    return -1;
+}
+
+int
+main (int argc, char *argv[])
+{
+    options opt = { .json = false, .scale = 1, .iterations = 3, .threads = 0 };
+    int only = -1, emit_only = -1;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp (argv[i], "--json") == 0)
+            opt.json = true;
+        else if (strcmp (argv[i], "--scale") == 0 && i + 1 < argc)
+            opt.scale = strtoul (argv[++i], NULL, 10);
+        else if (strcmp (argv[i], "--iterations") == 0 && i + 1 < argc)
+            opt.iterations = strtoul (argv[++i], NULL, 10);
+        else if (strcmp (argv[i], "--threads") == 0 && i + 1 < argc)
+            opt.threads = strtoul (argv[++i], NULL, 10);
+        else if (strcmp (argv[i], "--only") == 0 && i + 1 < argc)
+        {
+            if ((only = find_scenario (argv[++i])) < 0) return 1;
+        }
+        else if (strcmp (argv[i], "--emit") == 0 && i + 1 < argc)
+        {
+            if ((emit_only = find_scenario (argv[++i])) < 0) return 1;
+        }
+        else
+        {
+            fprintf (stderr, "usage: bench-suite [--json] [--scale N] [--iterations N] [--threads N] "
+                             "[--only scenario] [--emit scenario]\n");
+            return 1;
+        }
+    }
+
+    if (opt.scale == 0 || opt.iterations == 0) return 1;
+
+    if (emit_only >= 0)
+    {
+        score s = { 0 };
+        generate (&s, emit_only, opt.scale);
+        fwrite (s.items, 1, s.size, stdout);
+        free (s.items);
+        return 0;
+    }
+
+    if (opt.json)
+    {
+        mml_scan_select (MML_SCAN_AUTO);
+        printf ("{\"scale\": %u, \"iterations\": %u, \"threads\": %u, \"scanner\": \"%s\", \"scenarios\": [\n",
+                opt.scale, opt.iterations, opt.threads, mml_scan_name ());
+    }
+
+    int status = 0;
+    bool first = true;
+    for (int i = 0; i < SCENARIO_COUNT; ++i)
+    {
+        if (only >= 0 && i != only) continue;
+
+        fflush (stdout);
+        pid_t pid = fork ();
+        if (pid == 0)
+        {
+            int rc = run (i, &opt, first);
+            fflush (stdout);
+            _exit (rc);
+        }
+
+        int wstatus;
+        if (pid < 0 || waitpid (pid, &wstatus, 0) < 0 || !WIFEXITED (wstatus) || WEXITSTATUS (wstatus) != 0)
+        {
+            fprintf (stderr, "bench-suite: scenario `%s` failed\n", scenario_names[i]);
+            status = 1;
+            continue;
+        }
+        first = false;
+    }
+
+    if (opt.json) printf ("\n]}\n");
+    return status;
+}
@@ -0,0 +1,228 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright (C) 2026 virtualgrub39
+
+/* Checks the VLQ codec of midi-parser.h against the straightforward byte-at-a-time implementation over every
+ * valid MIDI value (0 .. 2^28 - 1, plus the 5-byte edge cases above), then reports ns/op of both for encoding and
+ * decoding, on deltas the way MML tracks produce them and on uniformly sized ones.
+ *
+ * usage: bench-vlq [--quick]
+ * --quick checks every 4093rd value instead of all of them. */
+
+#define _DEFAULT_SOURCE
+
+#define MIDI_PARSER_IMPLEMENTATION
+#include <midi-codec/midi-parser.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double
+now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* the codec as it was */
+
+static int
+reference_encode (uint32_t value, uint8_t *out_bytes)
+{
+    int i = 0;
+
+    if (value >= (1U << 28)) { out_bytes[i++] = ((value >> 28) & 0x7F) | 0x80; }
+    if (value >= (1U << 21)) { out_bytes[i++] = ((value >> 21) & 0x7F) | 0x80; }
+    if (value >= (1U << 14)) { out_bytes[i++] = ((value >> 14) & 0x7F) | 0x80; }
+    if (value >= (1U << 7)) { out_bytes[i++] = ((value >> 7) & 0x7F) | 0x80; }
+    out_bytes[i++] = (value & 0x7F);
+
+    return i;
+}
+
+static int
+reference_decode (const uint8_t *bytes, uint32_t len, uint32_t *out_value)
+{
+    uint32_t value = 0;
+
+    for (uint32_t i = 0; i < 5 && i < len; ++i)
+    {
+        uint8_t b = bytes[i];
+        value = (value << 7) | (b & 0x7F);
+
+        if ((b & 0x80) == 0)
+        {
+            *out_value = value;
+            return i + 1;
+        }
+    }
+
+    return -1;
+}
+
+static bool
+check (uint32_t value)
+{
+    uint8_t expect[8], wide[MIDI_VLQ_WIDE + 8], narrow[8];
+    int n = reference_encode (value, expect);
+
+    memset (wide, 0xFF, sizeof wide);
+    if (midi_vlq_encode_wide (value, wide) != n || memcmp (wide, expect, n) != 0) return false;
+    if (midi_vlq_encode (value, narrow) != n || memcmp (narrow, expect, n) != 0) return false;
+    if (midi_vlq_encode (value, NULL) != n) return false;
+
+    /* the single-load path (room to spare) and the byte loop (exact length) */
+    uint32_t decoded, reference = 0;
+    reference_decode (expect, n, &reference);
+    if (midi_vlq_decode (wide, sizeof wide, &decoded) != n || decoded != reference) return false;
+    if (midi_vlq_decode (expect, n, &decoded) != n || decoded != reference) return false;
+
+    return true;
+}
+
+static bool
+check_malformed (void)
+{
+    /* no terminator within 5 bytes, and a truncated VLQ */
+    static const uint8_t endless[16] = { 0x81, 0x82, 0x83, 0x84, 0x85, 0x06, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    uint32_t value;
+
+    if (midi_vlq_decode (endless, sizeof endless, &value) != -1) return false;
+    if (midi_vlq_decode (endless, 5, &value) != -1) return false;
+    if (midi_vlq_decode (endless, 3, &value) != -1) return false;
+
+    return true;
+}
+
+#define NVALUES (1 << 20)
+#define PASSES 64
+
+/* macros rather than functions taking a codec pointer, so that each codec is inlined into its loop */
+#define TIME_ENCODE(encode, values, out)                                                                               \
+    ({                                                                                                                 \
+        double _best = 1e30;                                                                                           \
+        for (int _pass = 0; _pass < PASSES / 8; ++_pass)                                                               \
+        {                                                                                                              \
+            double _start = now ();                                                                                    \
+            for (int _rep = 0; _rep < 8; ++_rep)                                                                       \
+            {                                                                                                          \
+                uint8_t *_p = (out);                                                                                   \
+                for (size_t _i = 0; _i < NVALUES; ++_i) _p += encode ((values)[_i], _p);                               \
+                __asm__ volatile ("" : : "r"(_p) : "memory");                                                          \
+            }                                                                                                          \
+            double _elapsed = (now () - _start) / 8;                                                                   \
+            if (_elapsed < _best) _best = _elapsed;                                                                    \
+        }                                                                                                              \
+        _best * 1e9 / NVALUES;                                                                                         \
+    })
+
+#define TIME_DECODE(decode, bytes, size, sum)                                                                          \
+    ({                                                                                                                 \
+        double _best = 1e30;                                                                                           \
+        for (int _pass = 0; _pass < PASSES / 8; ++_pass)                                                               \
+        {                                                                                                              \
+            double _start = now ();                                                                                    \
+            for (int _rep = 0; _rep < 8; ++_rep)                                                                       \
+            {                                                                                                          \
+                size_t _at = 0;                                                                                        \
+                while (_at < (size))                                                                                   \
+                {                                                                                                      \
+                    uint32_t _value = 0;                                                                               \
+                    int _n = decode ((bytes) + _at, (size) + MIDI_VLQ_WIDE - _at, &_value);                            \
+                    if (_n <= 0) break;                                                                                \
+                    _at += _n;                                                                                         \
+                    (sum) += _value;                                                                                   \
+                }                                                                                                      \
+            }                                                                                                          \
+            double _elapsed = (now () - _start) / 8;                                                                   \
+            if (_elapsed < _best) _best = _elapsed;                                                                    \
+        }                                                                                                              \
+        _best * 1e9 / NVALUES;                                                                                         \
+    })
+
+static void
+measure (const char *name, const uint32_t *values)
+{
+    uint8_t *bytes = malloc (NVALUES * 5 + MIDI_VLQ_WIDE);
+    uint64_t sum = 0;
+
+    double old_enc = TIME_ENCODE (reference_encode, values, bytes);
+    double new_enc = TIME_ENCODE (midi_vlq_encode_wide, values, bytes);
+
+    uint8_t *p = bytes;
+    for (size_t i = 0; i < NVALUES; ++i) p += reference_encode (values[i], p);
+    size_t size = p - bytes;
+    memset (p, 0, MIDI_VLQ_WIDE);
+
+    double old_dec = TIME_DECODE (reference_decode, bytes, size, sum);
+    double new_dec = TIME_DECODE (midi_vlq_decode, bytes, size, sum);
+
+    printf ("%-10s encode %6.2f -> %6.2f ns/op   decode %6.2f -> %6.2f ns/op   (%.2f bytes/value, %llu)\n", name,
+            old_enc, new_enc, old_dec, new_dec, (double)size / NVALUES, (unsigned long long)(sum & 0xF));
+    free (bytes);
+}
+
+int
+main (int argc, char *argv[])
+{
+    uint32_t step = argc > 1 && strcmp (argv[1], "--quick") == 0 ? 4093 : 1;
+
+    double start = now ();
+    uint64_t checked = 0;
+    for (uint32_t value = 0; value < (1u << 28); value += step, checked++)
+    {
+        if (!check (value))
+        {
+            printf ("MISMATCH at %u\n", value);
+            return 1;
+        }
+    }
+
+    /* above the MIDI range, only the 5-byte form */
+    static const uint32_t large[] = { 1u << 28, (1u << 28) + 1, 0x7FFFFFFF, 0x80000000, 0xFFFFFFFE, 0xFFFFFFFF };
+    for (size_t i = 0; i < sizeof large / sizeof *large; ++i, checked++)
+    {
+        if (!check (large[i]))
+        {
+            printf ("MISMATCH at %u\n", large[i]);
+            return 1;
+        }
+    }
+
+    if (!check_malformed ())
+    {
+        printf ("MISMATCH on malformed input\n");
+        return 1;
+    }
+
+    printf ("%llu values round-trip, identical to the reference (%.1f s)\n", (unsigned long long)checked,
+            now () - start);
+
+    uint32_t *values = malloc (NVALUES * sizeof *values);
+    unsigned seed = 1;
+
+    /* note on/off deltas: mostly 0 and short note lengths at 480 PPQ, one or two bytes */
+    static const uint32_t deltas[] = { 0, 0, 0, 0, 60, 120, 240, 480, 720, 960, 1920, 30 };
+    for (size_t i = 0; i < NVALUES; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        values[i] = deltas[(seed >> 16) % (sizeof deltas / sizeof *deltas)];
+    }
+    measure ("deltas", values);
+
+    /* 1 to 4 bytes with equal probability: the worst case for branch prediction */
+    for (size_t i = 0; i < NVALUES; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        unsigned bytes = (seed >> 16) % 4;
+        seed = seed * 1103515245 + 12345;
+        values[i] = (seed >> 4) & ((1u << (7 * (bytes + 1))) - 1);
+    }
+    measure ("uniform", values);
+
+    free (values);
+    return 0;
+}
@@ -0,0 +1,85 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright (C) 2026 virtualgrub39
+
+/* Encodes one dense track of notes to /dev/null and reports MIDI events per second; parsing is not timed.
+ *
+ * usage: bench-writer [notes] [iterations]
+ * Defaults to 1M notes, which become 2M note on/off events. */
+
+#define _DEFAULT_SOURCE
+
+#include "../source/mml2midi.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double
+now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static char *
+generate (size_t nnotes, size_t *out_size)
+{
+    static const char *const notes[] = { "c", "d", "e+", "f", "g16", "a", "b-", "c8" };
+
+    size_t capacity = nnotes * 5 + 64;
+    char *source = malloc (capacity);
+    size_t n = snprintf (source, capacity, "t132 l16 o4 ");
+    unsigned seed = 1;
+
+    for (size_t i = 0; i < nnotes; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        n += snprintf (source + n, capacity - n, "%s ", notes[(seed >> 16) % (sizeof notes / sizeof *notes)]);
+    }
+
+    n += snprintf (source + n, capacity - n, ";");
+
+    *out_size = n;
+    return source;
+}
+
+int
+main (int argc, char *argv[])
+{
+    size_t nnotes = argc > 1 ? strtoul (argv[1], NULL, 10) : 1000000;
+    int iterations = argc > 2 ? atoi (argv[2]) : 5;
+
+    size_t size;
+    char *source = generate (nnotes, &size);
+
+    mml_lexer lexer;
+    if (mml_lexer_init (&lexer, source, size) != 0) return 1;
+
+    mml_song song = { 0 };
+    if (mml_parse (&lexer, &song) != 0) return 1;
+
+    int fd = open ("/dev/null", O_WRONLY);
+    if (fd < 0) return 1;
+
+    double best = 1e30;
+    for (int it = 0; it < iterations; ++it)
+    {
+        double start = now ();
+        if (mml_write_midi_fd (&song, fd, 1) != 0) return 1;
+        double elapsed = now () - start;
+        if (elapsed < best) best = elapsed;
+    }
+
+    size_t nevents = nnotes * 2;
+    printf ("%zu notes: %8.3f ms  %8.1f Mevents/s  %6.2f ns/event\n", nnotes, best * 1e3, nevents / best / 1e6,
+            best * 1e9 / nevents);
+
+    close (fd);
+    mml_song_free (&song);
+    free (source);
+    return 0;
+}
@@ -5,6 +5,14 @@
 #include <stdio.h>
 #include <string.h>
 
+/* With MIDI_PARSER_STATIC, the implementation is private to the translation unit that includes it, where the
+ * compiler is free to inline it */
+#ifdef MIDI_PARSER_STATIC
+#define MIDI_PARSER_API static inline
+#else
+#define MIDI_PARSER_API
+#endif
+
 #define MIDI_NOTE_OFF 0x8
 #define MIDI_NOTE_ON 0x9
 #define MIDI_POLY_PRESSURE 0xA
@@ -79,20 +87,27 @@ typedef struct
     uint8_t last_status;
 } track_parser_t;
 
-int midi_vlq_encode (uint32_t value, uint8_t *out_bytes);
-int midi_vlq_decode (const uint8_t *bytes, uint32_t len, uint32_t *out_value);
+/* Longest VLQ: a 32-bit value takes 5 bytes; the wide encoder always stores this many bytes */
+#define MIDI_VLQ_WIDE 8
+
+/* Encodes `value` into `out_bytes` (which may be NULL, to only get the length); returns the length, 1 to 5 */
+MIDI_PARSER_API int midi_vlq_encode (uint32_t value, uint8_t *out_bytes);
+/* Same as `midi_vlq_encode`, without branches: always stores MIDI_VLQ_WIDE bytes, of which only the returned
+ * length is meaningful, so `out_bytes` needs that much room */
+MIDI_PARSER_API int midi_vlq_encode_wide (uint32_t value, uint8_t *out_bytes);
+/* Decodes the VLQ at `bytes`; returns its length, or -1 if no VLQ of at most 5 bytes ends within `len` bytes */
+MIDI_PARSER_API int midi_vlq_decode (const uint8_t *bytes, uint32_t len, uint32_t *out_value);
 
-int midi_event_to_bytes (const midi_event_t *e, uint8_t *out_bytes, int rolling);
-int midi_event_from_bytes (midi_event_t *e, const uint8_t *bytes, uint32_t len);
+MIDI_PARSER_API int midi_event_to_bytes (const midi_event_t *e, uint8_t *out_bytes, int rolling);
+MIDI_PARSER_API int midi_event_from_bytes (midi_event_t *e, const uint8_t *bytes, uint32_t len);
 
-uint32_t track_event_get_storage_size (const track_event_t *e);
-int track_event_to_bytes (const track_event_t *e, uint8_t *out_bytes);
-int track_event_next (track_parser_t *p, track_event_t *e);
+MIDI_PARSER_API uint32_t track_event_get_storage_size (const track_event_t *e);
+MIDI_PARSER_API int track_event_to_bytes (const track_event_t *e, uint8_t *out_bytes);
+MIDI_PARSER_API int track_event_next (track_parser_t *p, track_event_t *e);
 
-#define MIDI_PARSER_IMPLEMENTATION
 #ifdef MIDI_PARSER_IMPLEMENTATION
 
-uint32_t
+MIDI_PARSER_API uint32_t
 track_event_get_storage_size (const track_event_t *e)
 {
     uint32_t total = 0;
@@ -131,7 +146,7 @@ track_event_get_storage_size (const track_event_t *e)
     return total;
 }
 
-int
+MIDI_PARSER_API int
 midi_event_to_bytes (const midi_event_t *e, uint8_t *out_bytes, int rolling)
 {
     int ev_len = 0, i;
@@ -173,24 +188,50 @@ midi_event_to_bytes (const midi_event_t *e, uint8_t *out_bytes, int rolling)
     return ev_len;
 }
 
-int
+static inline int
+_midi_vlq_length (uint32_t value)
+{
+    /* 7 bits per byte: 1 + (significant bits - 1) / 7, with value 0 taking one byte */
+    return (38 - __builtin_clz (value | 1)) / 7;
+}
+
+MIDI_PARSER_API int
+midi_vlq_encode_wide (uint32_t value, uint8_t *out_bytes)
+{
+    uint64_t v = value, groups;
+    int n = _midi_vlq_length (value);
+
+    /* one 7-bit group per byte, least significant group in the lowest byte */
+    groups = (v & 0x7F) | (v & 0x3F80) << 1 | (v & 0x1FC000) << 2 | (v & 0xFE00000) << 3 | (v & 0xF0000000) << 4;
+    /* continuation bits on every byte but the last one written, i.e. the lowest group */
+    groups |= 0x8080808080ull & ((1ull << (8 * n)) - 1) & ~0xFFull;
+    /* most significant group first */
+    groups = __builtin_bswap64 (groups) >> (64 - 8 * n);
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy (out_bytes, &groups, sizeof groups);
+#else
+    for (int i = 0; i < MIDI_VLQ_WIDE; ++i) out_bytes[i] = groups >> (8 * i);
+#endif
+
+    return n;
+}
+
+MIDI_PARSER_API int
 midi_vlq_encode (uint32_t value, uint8_t *out_bytes)
 {
-    int i = 0;
-    uint8_t devnull[5];
+    uint8_t wide[MIDI_VLQ_WIDE];
+    int i, n;
 
-    if (out_bytes == NULL) out_bytes = devnull;
+    if (out_bytes == NULL) return _midi_vlq_length (value);
 
-    if (value >= (1U << 28)) { out_bytes[i++] = ((value >> 28) & 0x7F) | 0x80; }
-    if (value >= (1U << 21)) { out_bytes[i++] = ((value >> 21) & 0x7F) | 0x80; }
-    if (value >= (1U << 14)) { out_bytes[i++] = ((value >> 14) & 0x7F) | 0x80; }
-    if (value >= (1U << 7)) { out_bytes[i++] = ((value >> 7) & 0x7F) | 0x80; }
-    out_bytes[i++] = (value & 0x7F);
+    n = midi_vlq_encode_wide (value, wide);
+    for (i = 0; i < n; ++i) out_bytes[i] = wide[i];
 
-    return i;
+    return n;
 }
 
-int
+MIDI_PARSER_API int
 midi_vlq_decode (const uint8_t *bytes, uint32_t len, uint32_t *out_value)
 {
     uint32_t value = 0;
@@ -200,6 +241,26 @@ midi_vlq_decode (const uint8_t *bytes, uint32_t len, uint32_t *out_value)
     if (bytes == NULL || out_value == NULL) return -1;
     if (len == 0) return -1;
 
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    /* one unaligned 64-bit load covers any VLQ, and the common 1 and 2 byte ones cost no more than the rest: no
+     * branch depends on the length. The last byte is the first one without its top bit set. */
+    if (len >= 8)
+    {
+        uint64_t x, last;
+        int n;
+
+        memcpy (&x, bytes, sizeof x);
+        last = ~x & 0x8080808080ull;
+        if (last == 0) return -1;
+
+        n = __builtin_ctzll (last) / 8 + 1;
+        x = __builtin_bswap64 (x & 0x7F7F7F7F7Full & ((1ull << (8 * n)) - 1)) >> (64 - 8 * n);
+        *out_value
+            = (x & 0x7F) | (x >> 1 & 0x3F80) | (x >> 2 & 0x1FC000) | (x >> 3 & 0xFE00000) | (x >> 4 & 0xF0000000);
+        return n;
+    }
+#endif
+
     for (i = 0; i < 5 && i < len; ++i)
     {
         b = bytes[i];
@@ -215,7 +276,7 @@ midi_vlq_decode (const uint8_t *bytes, uint32_t len, uint32_t *out_value)
     return -1;
 }
 
-int
+MIDI_PARSER_API int
 track_event_to_bytes (const track_event_t *e, uint8_t *out_bytes)
 {
     int n = 0, m;
@@ -251,7 +312,7 @@ track_event_to_bytes (const track_event_t *e, uint8_t *out_bytes)
     return n;
 }
 
-int
+MIDI_PARSER_API int
 midi_event_from_bytes (midi_event_t *e, const uint8_t *bytes, uint32_t len)
 {
     uint8_t kind, chan;
@@ -293,7 +354,7 @@ midi_event_from_bytes (midi_event_t *e, const uint8_t *bytes, uint32_t len)
     return bytes_used;
 }
 
-int
+static inline int
 midi_event_from_bytes_rolling (midi_event_t *e, uint8_t status, const uint8_t *bytes, uint32_t len)
 {
     uint8_t kind, chan;
@@ -335,71 +396,74 @@ midi_event_from_bytes_rolling (midi_event_t *e, uint8_t status, const uint8_t *b
     return bytes_used;
 }
 
-int
+MIDI_PARSER_API int
 track_event_next (track_parser_t *p, track_event_t *e)
 {
-    uint32_t delta;
-    uint32_t bytes_left = 0;
+    uint32_t delta, idx, bytes_left, vlength;
     int32_t ev_len = 0, n = 0;
     uint8_t b;
 
     if (p == NULL || e == NULL) return -1;
-
-    if ((n = midi_vlq_decode (p->bytes + p->idx, p->len - p->idx, &delta)) <= 0) return -1;
-
-    p->idx += n;
-    e->delta = delta;
-
-    bytes_left = p->len - p->idx;
+    if (p->idx >= p->len) return -1;
+
+    /* nothing is consumed unless the whole event lies within `len`, so that on failure `idx` is where it starts.
+     * Most deltas fit in one byte: on a predicted branch, the next event is found without waiting for the decode. */
+    if (p->bytes[p->idx] < 0x80)
+        delta = p->bytes[p->idx], n = 1;
+    else if (p->len - p->idx >= 2 && p->bytes[p->idx + 1] < 0x80)
+        delta = (p->bytes[p->idx] & 0x7F) << 7 | p->bytes[p->idx + 1], n = 2;
+    else if ((n = midi_vlq_decode (p->bytes + p->idx, p->len - p->idx, &delta)) <= 0)
+        return -1;
+
+    idx = p->idx + n;
+    bytes_left = p->len - idx;
     if (bytes_left == 0) return -1;
 
-    b = p->bytes[p->idx];
+    b = p->bytes[idx];
 
     if (b >= 0x80 && b < 0xF0) /* MIDI */
     {
-        if ((ev_len = midi_event_from_bytes (&e->as.midi, (const uint8_t *)p->bytes + p->idx, bytes_left)) <= 0)
-            return -1;
+        if ((ev_len = midi_event_from_bytes (&e->as.midi, p->bytes + idx, bytes_left)) <= 0) return -1;
         e->kind = EV_MIDI;
         p->last_status = b;
     }
     else if (b == 0xF0 || b == 0xF7) /* SYSEX */
     {
-        uint32_t vlength;
-        if ((n = midi_vlq_decode (p->bytes + p->idx + 1, p->len - p->idx - 1, &vlength)) <= 0) return -1;
+        if ((n = midi_vlq_decode (p->bytes + idx + 1, bytes_left - 1, &vlength)) <= 0) return -1;
+        if (vlength > bytes_left - 1 - n) return -1;
 
         e->kind = EV_SYSEX;
-        e->as.sysex.data = (const uint8_t *)p->bytes + p->idx + 1 + n;
-        e->as.sysex.length = vlength - 1;
+        e->as.sysex.data = p->bytes + idx + 1 + n;
+        e->as.sysex.length = vlength ? vlength - 1 : 0;
 
         ev_len = 1 + n + vlength;
+        p->last_status = 0; /* sysex and meta events cancel running status */
     }
     else if (b == 0xFF) /* META */
     {
-        uint8_t type = p->bytes[p->idx + 1];
-        uint32_t vlength;
-        if ((n = midi_vlq_decode (p->bytes + p->idx + 2, p->len - p->idx - 2, &vlength)) <= 0) return -1;
+        if (bytes_left < 3) return -1;
+        if ((n = midi_vlq_decode (p->bytes + idx + 2, bytes_left - 2, &vlength)) <= 0) return -1;
+        if (vlength > bytes_left - 2 - n) return -1;
 
         e->kind = EV_META;
-        e->as.meta.type = type;
-        e->as.meta.data = (const uint8_t *)p->bytes + p->idx + 2 + n;
+        e->as.meta.type = p->bytes[idx + 1];
+        e->as.meta.data = p->bytes + idx + 2 + n;
         e->as.meta.length = vlength;
 
         ev_len = 2 + n + vlength;
+        p->last_status = 0;
     }
-    else
+    else if (b < 0x80 && p->last_status) /* rolling status */
     {
-        if (p->last_status >= 0x80 && p->last_status < 0xF0) /* rolling status */
-        {
-            ev_len = midi_event_from_bytes_rolling (&e->as.midi, p->last_status, (const uint8_t *)p->bytes + p->idx,
-                                                    bytes_left);
-            if (ev_len <= 0) return -1;
-            e->kind = EV_MIDI;
-        }
-        else
-            return -1;
+        ev_len = midi_event_from_bytes_rolling (&e->as.midi, p->last_status, p->bytes + idx, bytes_left);
+        if (ev_len <= 0) return -1;
+        e->kind = EV_MIDI;
     }
+    else /* a data byte without a status to run, or a system message, which an SMF cannot hold */
+        return -1;
 
-    p->idx += ev_len;
+    e->delta = delta;
+    p->idx = idx + ev_len;
 
     return ev_len;
 }
@@ -5,14 +5,23 @@
 #define MIDI_FMT_MTRACK 1
 #define MIDI_FMT_MSONG 2
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Receives output in buffered mode: `count` byte ranges, to be written in order.
+ * Returns 0 on success, -1 on failure */
+typedef int (*mw_sink_t) (void *user, const struct iovec *iov, int count);
 
 /* This structure MUST be zero-initialized before use */
 typedef struct
 {
     /* writer state */
-    FILE *dst;  /* destination file */
+    FILE *dst;  /* destination file; NULL in buffered mode */
     uint32_t i; /* current file offset */
     /* header info */
     uint16_t ntracks; /* count of `mw_track_begin` calls */
@@ -21,6 +30,14 @@ typedef struct
     /* [ MTrk:4 ][ Track-len:4 ][ Track data:... ] */
     /*                          ^              */
     /* used for patching Track-len, after `mw_track_end` is called */
+
+    /* buffered mode: tracks are assembled in memory and go out whole, so the destination is never seeked */
+    mw_sink_t sink;
+    void *sink_user;
+    int fd;                   /* destination of `mw_begin_fd` */
+    uint16_t ntracks_decl;    /* track count written in the header up front */
+    uint8_t *buf;             /* event data of the current track */
+    uint32_t buf_len, buf_cap;
 } midi_writer_t;
 
 /* Initializes MIDI writer context; Tries to write MIDI header bytes;
@@ -28,13 +45,39 @@ typedef struct
  * On failure (write failed, NULL argument), returns -1, without setting any error indicator; */
 int mw_begin (midi_writer_t *mw, FILE *dst, uint16_t format, uint16_t tickdiv);
 
+/* Initializes MIDI writer context in buffered mode, where no output is ever seeked, so it works with pipes and
+ * sockets; Since the header goes out first, the number of tracks must be known up front;
+ * Each track is built in memory and handed to `sink` in one call once its length is known;
+ * On success, passes the complete MIDI header to the sink, and returns 0;
+ * On failure (NULL argument, sink failed), returns -1, without setting any error indicator; */
+int mw_begin_sink (midi_writer_t *mw, mw_sink_t sink, void *user, uint16_t format, uint16_t tickdiv,
+                   uint16_t ntracks);
+
+/* Same as `mw_begin_sink`, with a sink that `writev`s to the file descriptor `fd` */
+int mw_begin_fd (midi_writer_t *mw, int fd, uint16_t format, uint16_t tickdiv, uint16_t ntracks);
+
 /* Filnalizes MIDI file, by updating the placeholder data in the MIDI header.
  * This function does not end current track, nor checks if the MIDI header has been written, so make sure appropriate
  * functions have been called before calling this function;
  * On success, updates MIDI header placeholders with true values, and returns 0;
- * On failure (seeking or write failed), returns -1, without setting any error indicator; */
+ * In buffered mode, only checks the track count declared up front, and releases the track buffer;
+ * On failure (seeking or write failed), returns -1, without setting any error indicator;
+ * When the count of tracks written differs from the one declared, returns -1 with errno set to EINVAL; */
 int mw_end (midi_writer_t *mw);
 
+/* Appends a complete track, whose event data is already in memory, with a single write;
+ * Must not be called between `mw_track_begin` and `mw_track_end`;
+ * In buffered mode the data is passed to the sink as is, without being copied;
+ * On success, writes MIDI track header and data, and returns 0;
+ * On failure (NULL-argument, write failed) returns -1, without setting any error indicator; */
+int mw_track_chunk (midi_writer_t *mw, const uint8_t *data, uint32_t len);
+
+/* Same as `mw_track_chunk` in buffered mode, without a writer context: the chunk is `writev`d to `fd` as is;
+ * Meant for files whose header went out already, through `mw_begin_fd` or otherwise;
+ * On success, writes MIDI track header and data, and returns 0;
+ * On failure (NULL-argument, write failed) returns -1, without setting any error indicator; */
+int mw_track_chunk_fd (int fd, const uint8_t *data, uint32_t len);
+
 /* Begins new MIDI track, by appending track header.
  * This function does not end previous track, nor checks if the MIDI header has been written, so make sure appropriate
  * functions have been called before calling this function;
@@ -52,6 +95,7 @@ int mw_track_begin (midi_writer_t *mw);
 int mw_track_append (midi_writer_t *mw, const uint8_t *data, uint32_t len);
 
 /* Finalizes current track, by filling out placeholder data in previous track header;
+ * In buffered mode, writes the whole track instead;
  * This function does not check, if the track header exists, nor if MIDI header has been written, so make sure
  * appropriate functions have been called before calling this function;
  * On success, updates track header placeholders with true values, and returns 0;
@@ -90,6 +134,114 @@ _mw_write_u16 (midi_writer_t *mw, uint16_t u16)
     return n - 2;
 }
 
+static void
+_mw_put_u32 (uint8_t *b, uint32_t u32)
+{
+    b[0] = u32 >> 24;
+    b[1] = u32 >> 16;
+    b[2] = u32 >> 8;
+    b[3] = u32;
+}
+
+static int
+_mw_fd_sink (void *user, const struct iovec *iov, int count)
+{
+    int fd = *(const int *)user;
+    struct iovec v[4];
+    ssize_t n;
+
+    if (count > 4) return -1;
+    memcpy (v, iov, count * sizeof *v);
+
+    /* writev may stop short on pipes and sockets; resume where it did */
+    while (count > 0)
+    {
+        n = writev (fd, v, count);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        while (count > 0 && (size_t)n >= v[0].iov_len)
+        {
+            n -= v[0].iov_len;
+            memmove (v, v + 1, --count * sizeof *v);
+        }
+        if (count > 0)
+        {
+            v[0].iov_base = (uint8_t *)v[0].iov_base + n;
+            v[0].iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+static int
+_mw_emit_track (midi_writer_t *mw, const uint8_t *data, uint32_t len)
+{
+    uint8_t head[8];
+    struct iovec iov[2];
+
+    _mw_put_u32 (head, 0x4d54726b);
+    _mw_put_u32 (head + 4, len);
+
+    iov[0].iov_base = head;
+    iov[0].iov_len = sizeof head;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+
+    if (mw->sink (mw->sink_user, iov, len ? 2 : 1) != 0) return -1;
+
+    mw->i += sizeof head + len;
+    mw->ntracks += 1;
+    return 0;
+}
+
+int
+mw_begin_sink (midi_writer_t *mw, mw_sink_t sink, void *user, uint16_t format, uint16_t tickdiv, uint16_t ntracks)
+{
+    uint8_t head[14];
+    struct iovec iov;
+
+    if (!mw) return -1;
+    if (!sink) return -1;
+
+    mw->dst = NULL;
+    mw->sink = sink;
+    mw->sink_user = user;
+    mw->i = 0;
+    mw->ntracks = 0;
+    mw->ntracks_decl = ntracks;
+    mw->buf_len = 0;
+
+    _mw_put_u32 (head, 0x4d546864); /* magic */
+    _mw_put_u32 (head + 4, 6);      /* header length */
+    head[8] = format >> 8;
+    head[9] = format;
+    head[10] = ntracks >> 8;
+    head[11] = ntracks;
+    head[12] = tickdiv >> 8;
+    head[13] = tickdiv;
+
+    iov.iov_base = head;
+    iov.iov_len = sizeof head;
+    if (sink (user, &iov, 1) != 0) return -1;
+    mw->i = sizeof head;
+
+    return 0;
+}
+
+int
+mw_begin_fd (midi_writer_t *mw, int fd, uint16_t format, uint16_t tickdiv, uint16_t ntracks)
+{
+    if (!mw) return -1;
+
+    mw->fd = fd;
+    return mw_begin_sink (mw, _mw_fd_sink, &mw->fd, format, tickdiv, ntracks);
+}
+
 int
 mw_begin (midi_writer_t *mw, FILE *dst, uint16_t format, uint16_t tickdiv)
 {
@@ -114,6 +266,12 @@ mw_track_begin (midi_writer_t *mw)
 {
     if (!mw) return -1;
 
+    if (mw->sink)
+    {
+        mw->buf_len = 0;
+        return 0;
+    }
+
     if (_mw_write_u32 (mw, 0x4d54726b) != 0) return -1; /* magic */
     if (_mw_write_u32 (mw, 0xFAFAFAFA) != 0) return -1; /* track_len (placeholder) */
 
@@ -128,6 +286,26 @@ mw_track_append (midi_writer_t *mw, const uint8_t *data, uint32_t len)
     if (!mw) return -1;
     if (!data || len == 0) return -1;
 
+    if (mw->sink)
+    {
+        if (mw->buf_cap - mw->buf_len < len)
+        {
+            uint32_t cap = mw->buf_cap ? mw->buf_cap : 4096;
+            uint8_t *buf;
+
+            while (cap - mw->buf_len < len) cap *= 2;
+            buf = realloc (mw->buf, cap);
+            if (!buf) return -1;
+
+            mw->buf = buf;
+            mw->buf_cap = cap;
+        }
+
+        memcpy (mw->buf + mw->buf_len, data, len);
+        mw->buf_len += len;
+        return 0;
+    }
+
     if (fwrite (data, sizeof *data, len, mw->dst) != len)
     {
         fseek (mw->dst, mw->i, SEEK_SET);
@@ -146,6 +324,8 @@ mw_track_end (midi_writer_t *mw)
 
     if (!mw) return -1;
 
+    if (mw->sink) return _mw_emit_track (mw, mw->buf, mw->buf_len);
+
     saved_i = mw->i;
 
     if (fseek (mw->dst, mw->track_offset - 4, SEEK_SET) != 0) return -1;
@@ -165,10 +345,48 @@ mw_track_end (midi_writer_t *mw)
     return 0;
 }
 
+int
+mw_track_chunk (midi_writer_t *mw, const uint8_t *data, uint32_t len)
+{
+    if (!mw) return -1;
+    if (!data && len) return -1;
+
+    if (mw->sink) return _mw_emit_track (mw, data, len);
+
+    if (mw_track_begin (mw) != 0) return -1;
+    if (len && mw_track_append (mw, data, len) != 0) return -1;
+    return mw_track_end (mw);
+}
+
+int
+mw_track_chunk_fd (int fd, const uint8_t *data, uint32_t len)
+{
+    midi_writer_t mw = { 0 };
+
+    if (!data && len) return -1;
+
+    mw.fd = fd;
+    mw.sink = _mw_fd_sink;
+    mw.sink_user = &mw.fd;
+    return _mw_emit_track (&mw, data, len);
+}
+
 int
 mw_end (midi_writer_t *mw)
 {
     if (!mw) return -1;
+    if (mw->sink)
+    {
+        free (mw->buf);
+        mw->buf = NULL;
+        mw->buf_len = mw->buf_cap = 0;
+        if (mw->ntracks != mw->ntracks_decl)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        return 0;
+    }
     if (mw->dst)
     {
         fseek (mw->dst, 10, SEEK_SET);
@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright (C) 2026 virtualgrub39
+
+#include "mml2midi.h"
+
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+#define ARENA_ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct mml_arena_block
+{
+    mml_arena_block *next;
+    size_t used, capacity;
+    size_t last; /* offset of the most recent allocation, which can grow in place */
+    alignas (ARENA_ALIGN) unsigned char bytes[];
+};
+
+static mml_arena_block *
+arena_new_block (mml_arena *arena, size_t min_size)
+{
+    size_t capacity = arena->head ? arena->head->capacity * 2 : MML_ARENA_BLOCK;
+    if (capacity > MML_ARENA_BLOCK_MAX) capacity = MML_ARENA_BLOCK_MAX;
+    if (capacity < min_size) capacity = min_size;
+
+    mml_arena_block *block = malloc (sizeof *block + capacity);
+    if (!block) return NULL;
+
+    *block = (mml_arena_block){ .next = arena->head, .used = 0, .capacity = capacity, .last = 0 };
+    arena->head = block;
+    arena->blocks += 1;
+    arena->reserved += capacity;
+
+    return block;
+}
+
+void *
+mml_arena_alloc (mml_arena *arena, size_t size)
+{
+    if (!arena) return malloc (size);
+
+    size = ARENA_ALIGN_UP (size);
+
+    mml_arena_block *block = arena->head;
+    if (!block || block->capacity - block->used < size)
+    {
+        if (!(block = arena_new_block (arena, size))) return NULL;
+    }
+
+    void *ptr = block->bytes + block->used;
+    block->last = block->used;
+    block->used += size;
+
+    return ptr;
+}
+
+void *
+mml_arena_realloc (mml_arena *arena, void *ptr, size_t old_size, size_t new_size)
+{
+    if (!arena) return realloc (ptr, new_size);
+    if (!ptr) return mml_arena_alloc (arena, new_size);
+
+    /* the latest allocation of the current block grows in place */
+    mml_arena_block *block = arena->head;
+    if (block && ptr == block->bytes + block->last)
+    {
+        size_t size = ARENA_ALIGN_UP (new_size);
+        if (block->capacity - block->last >= size)
+        {
+            block->used = block->last + size;
+            return ptr;
+        }
+    }
+
+    if (new_size <= old_size) return ptr;
+
+    void *new_ptr = mml_arena_alloc (arena, new_size);
+    if (new_ptr) memcpy (new_ptr, ptr, old_size);
+
+    return new_ptr;
+}
+
+void
+mml_arena_reset (mml_arena *arena)
+{
+    if (!arena || !arena->head) return;
+
+    /* keep the largest block, so a session that compiles many files settles into one allocation; it is not always
+     * the newest, as a block made for one oversized allocation can be followed by a smaller one */
+    mml_arena_block *keep = arena->head;
+    for (mml_arena_block *block = keep->next; block; block = block->next)
+        if (block->capacity > keep->capacity) keep = block;
+
+    mml_arena_block *block = arena->head;
+    while (block)
+    {
+        mml_arena_block *next = block->next;
+        if (block != keep) free (block);
+        block = next;
+    }
+
+    *keep = (mml_arena_block){ .next = NULL, .used = 0, .capacity = keep->capacity, .last = 0 };
+    arena->head = keep;
+    arena->reserved = keep->capacity;
+}
+
+void
+mml_arena_free (mml_arena *arena)
+{
+    if (!arena) return;
+
+    mml_arena_block *block = arena->head;
+    while (block)
+    {
+        mml_arena_block *next = block->next;
+        free (block);
+        block = next;
+    }
+
+    arena->head = NULL;
+    arena->reserved = 0;
+}
@@ -0,0 +1,446 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright (C) 2026 virtualgrub39
+
+/* Batch mode: compiles many files in one process, on a pool of worker threads.
+ *
+ * usage: mml2midi --batch <manifest|directory> [-j workers] [-o outdir] [--compare] [--cache dir [--cache-max MiB]]
+ *
+ * A manifest lists one job per line, `input.mml [output.mid]`; blank lines and lines starting with '#' are skipped.
+ * A directory compiles every `*.mml` file in it. Without an explicit output, the output is the input with its
+ * extension replaced by `.mid`, placed in `outdir` when one is given. `--compare` then compiles the same files
+ * again with one process per file, to report what batching saves. `--cache` compiles through an on-disk cache
+ * (see mml-cache.c), which any number of concurrent batches can share. */
+
+#define _DEFAULT_SOURCE
+
+#include "mml2midi.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+typedef struct
+{
+    const char *input, *output;
+} batch_job;
+
+typedef struct
+{
+    batch_job *items;
+    size_t size, capacity;
+} batch_jobs;
+
+typedef struct batch batch;
+
+/* Each worker owns a range of the job list. It takes jobs from the back of its own range and, once that is empty,
+ * steals from the front of the others'. Jobs take far longer than the lock, so a mutex per range is enough. */
+typedef struct
+{
+    pthread_mutex_t lock;
+    size_t head, tail;
+
+    batch *batch;
+    size_t index;
+    pthread_t thread;
+
+    mml_song song;   /* parser state, reset between files so the arena is reused */
+    mml_split split; /* with a cache, for the files that miss */
+    size_t files, bytes, failed, stolen;
+} batch_worker;
+
+struct batch
+{
+    batch_jobs jobs;
+    batch_worker *workers;
+    size_t nworkers;
+    mml_cache *cache; /* NULL = none */
+};
+
+static double
+now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static char *
+arena_strndup (mml_arena *arena, const char *s, size_t n)
+{
+    char *copy = mml_arena_alloc (arena, n + 1);
+    memcpy (copy, s, n);
+    copy[n] = 0;
+    return copy;
+}
+
+/* `input` with its extension replaced by `.mid`, in `outdir` if not NULL */
+static const char *
+output_path (mml_arena *arena, const char *input, const char *outdir)
+{
+    const char *name = input;
+    if (outdir)
+    {
+        const char *slash = strrchr (input, '/');
+        if (slash) name = slash + 1;
+    }
+
+    size_t stem = strlen (name);
+    const char *dot = strrchr (name, '.');
+    if (dot && !strchr (dot, '/')) stem = dot - name;
+
+    size_t dirlen = outdir ? strlen (outdir) : 0;
+    char *path = mml_arena_alloc (arena, dirlen + 1 + stem + sizeof ".mid");
+    size_t n = 0;
+    if (outdir)
+    {
+        memcpy (path, outdir, dirlen);
+        n = dirlen;
+        if (n && path[n - 1] != '/') path[n++] = '/';
+    }
+    memcpy (path + n, name, stem);
+    memcpy (path + n + stem, ".mid", sizeof ".mid");
+
+    return path;
+}
+
+static void
+add_job (mml_arena *arena, batch_jobs *jobs, const char *input, const char *output, const char *outdir)
+{
+    batch_job job = { .input = input, .output = output ? output : output_path (arena, input, outdir) };
+    da_append (arena, jobs, job);
+}
+
+static int
+compare_names (const void *a, const void *b)
+{
+    return strcmp (((const batch_job *)a)->input, ((const batch_job *)b)->input);
+}
+
+static int
+collect_directory (mml_arena *arena, batch_jobs *jobs, const char *dir, const char *outdir)
+{
+    DIR *d = opendir (dir);
+    if (!d)
+    {
+        perror ("mml: Failed to open batch directory");
+        return -1;
+    }
+
+    size_t first = jobs->size;
+    size_t dirlen = strlen (dir);
+    for (struct dirent *e; (e = readdir (d));)
+    {
+        size_t len = strlen (e->d_name);
+        if (len <= 4 || strcmp (e->d_name + len - 4, ".mml") != 0) continue;
+        if (e->d_type != DT_REG && e->d_type != DT_LNK && e->d_type != DT_UNKNOWN) continue;
+
+        char *path = mml_arena_alloc (arena, dirlen + 1 + len + 1);
+        memcpy (path, dir, dirlen);
+        path[dirlen] = '/';
+        memcpy (path + dirlen + 1, e->d_name, len + 1);
+        add_job (arena, jobs, path, NULL, outdir);
+    }
+    closedir (d);
+
+    /* readdir order is arbitrary; sorted, the outputs and the report are reproducible */
+    qsort (jobs->items + first, jobs->size - first, sizeof *jobs->items, compare_names);
+    return 0;
+}
+
+static int
+collect_manifest (mml_arena *arena, batch_jobs *jobs, const char *path, const char *outdir)
+{
+    char *text = mml_read_all (path);
+    if (!text) return -1;
+
+    for (char *line = text; *line;)
+    {
+        char *end = strchr (line, '\n');
+        if (!end) end = line + strlen (line);
+        char *next = *end ? end + 1 : end;
+
+        const char *fields[2] = { 0 };
+        size_t lengths[2] = { 0 };
+        size_t nfields = 0;
+        for (char *p = line; p < end && nfields < 2;)
+        {
+            while (p < end && mml_char_table[(unsigned char)*p].flags & MML_CC_SPACE) p++;
+            if (p == end || (nfields == 0 && *p == '#')) break;
+
+            char *start = p;
+            while (p < end && !(mml_char_table[(unsigned char)*p].flags & MML_CC_SPACE)) p++;
+            fields[nfields] = start;
+            lengths[nfields++] = p - start;
+        }
+
+        if (nfields > 0)
+        {
+            const char *input = arena_strndup (arena, fields[0], lengths[0]);
+            const char *output = nfields > 1 ? arena_strndup (arena, fields[1], lengths[1]) : NULL;
+            add_job (arena, jobs, input, output, outdir);
+        }
+
+        line = next;
+    }
+
+    free (text);
+    return 0;
+}
+
+static batch_job *
+take_job (batch_worker *w)
+{
+    batch *b = w->batch;
+    size_t job = SIZE_MAX;
+
+    pthread_mutex_lock (&w->lock);
+    if (w->head < w->tail) job = --w->tail;
+    pthread_mutex_unlock (&w->lock);
+
+    for (size_t k = 1; job == SIZE_MAX && k < b->nworkers; ++k)
+    {
+        batch_worker *victim = &b->workers[(w->index + k) % b->nworkers];
+
+        pthread_mutex_lock (&victim->lock);
+        if (victim->head < victim->tail) job = victim->head++;
+        pthread_mutex_unlock (&victim->lock);
+
+        if (job != SIZE_MAX) w->stolen += 1;
+    }
+
+    return job == SIZE_MAX ? NULL : &b->jobs.items[job];
+}
+
+static bool
+compile_job (batch_worker *w, const batch_job *job)
+{
+    mml_source source;
+    if (mml_source_open (&source, job->input, 0) != 0) return false;
+
+    w->bytes += source.size;
+
+    if (w->batch->cache)
+    {
+        int errors = mml_cache_compile (w->batch->cache, &source, job->input, job->output, &w->song, &w->split);
+        if (errors < 0) perror ("mml: Failed to write output");
+        mml_source_close (&source);
+        return errors == 0;
+    }
+
+    mml_lexer lexer;
+    if (mml_lexer_init (&lexer, source.data, source.size) != 0)
+    {
+        perror ("mml: Failed to read from file");
+        mml_source_close (&source);
+        return false;
+    }
+
+    mml_song_reset (&w->song);
+    int errors = mml_parse (&lexer, &w->song);
+
+    if (w->song.diagnostics.size)
+    {
+        /* one file's diagnostics stay together, whatever the other workers print */
+        flockfile (stderr);
+        mml_diagnostics_print (stderr, job->input, source.data, source.size, &w->song.diagnostics);
+        funlockfile (stderr);
+    }
+
+    bool ok = errors <= 0;
+    /* the pool already keeps every CPU busy, so each file is encoded on its worker alone */
+    if (ok && mml_write_midi (&w->song, job->output, 1) != 0)
+    {
+        perror ("mml: Failed to write output");
+        ok = false;
+    }
+
+    mml_source_close (&source);
+    return ok;
+}
+
+static void *
+worker_main (void *arg)
+{
+    batch_worker *w = arg;
+
+    for (const batch_job *job; (job = take_job (w));)
+    {
+        w->files += 1;
+        if (!compile_job (w, job))
+        {
+            w->failed += 1;
+            fprintf (stderr, "mml: failed: %s\n", job->input);
+        }
+    }
+
+    return NULL;
+}
+
+/* Compiles every job in a process of its own, the way the pipeline did without batch mode. */
+static double
+run_single_process (const batch_jobs *jobs)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init (&actions);
+    posix_spawn_file_actions_addopen (&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen (&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0); /* already reported */
+
+    double start = now ();
+    for (size_t i = 0; i < jobs->size; ++i)
+    {
+        char *args[] = { "mml2midi", (char *)jobs->items[i].input, (char *)jobs->items[i].output, NULL };
+        pid_t pid;
+        if (posix_spawn (&pid, "/proc/self/exe", &actions, NULL, args, environ) != 0) continue;
+
+        int status;
+        waitpid (pid, &status, 0);
+    }
+    double elapsed = now () - start;
+
+    posix_spawn_file_actions_destroy (&actions);
+    return elapsed;
+}
+
+static void
+usage (void)
+{
+    fprintf (stderr,
+             "usage: mml2midi --batch <manifest|directory> [-j workers] [-o outdir] [--compare] [--cache dir "
+             "[--cache-max MiB]]\n");
+}
+
+int
+mml_batch_main (int argc, char *argv[])
+{
+    const char *list = NULL, *outdir = NULL, *cache_dir = NULL;
+    size_t cache_max = MML_CACHE_MAX_MIB;
+    long nworkers = sysconf (_SC_NPROCESSORS_ONLN);
+    bool compare = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp (argv[i], "-j") == 0 && i + 1 < argc)
+            nworkers = strtol (argv[++i], NULL, 10);
+        else if (strcmp (argv[i], "-o") == 0 && i + 1 < argc)
+            outdir = argv[++i];
+        else if (strcmp (argv[i], "--cache") == 0 && i + 1 < argc)
+            cache_dir = argv[++i];
+        else if (strcmp (argv[i], "--cache-max") == 0 && i + 1 < argc)
+            cache_max = strtoul (argv[++i], NULL, 10);
+        else if (strcmp (argv[i], "--compare") == 0)
+            compare = true;
+        else if (!list && argv[i][0] != '-')
+            list = argv[i];
+        else
+        {
+            usage ();
+            return 1;
+        }
+    }
+
+    if (!list || nworkers < 1)
+    {
+        usage ();
+        return 1;
+    }
+
+    mml_arena arena = { 0 };
+    batch b = { 0 };
+
+    DIR *d = opendir (list);
+    int result;
+    if (d)
+    {
+        closedir (d);
+        result = collect_directory (&arena, &b.jobs, list, outdir);
+    }
+    else
+        result = collect_manifest (&arena, &b.jobs, list, outdir);
+
+    if (result != 0)
+    {
+        mml_arena_free (&arena);
+        return 2;
+    }
+
+    mml_cache cache;
+    if (cache_dir)
+    {
+        if (mml_cache_open (&cache, cache_dir, cache_max << 20) != 0)
+        {
+            perror ("mml: Failed to open cache");
+            mml_arena_free (&arena);
+            return 2;
+        }
+        b.cache = &cache;
+    }
+
+    /* pick the scanners up front, rather than have every worker race through the resolvers */
+    mml_scan_select (MML_SCAN_AUTO);
+
+    if ((size_t)nworkers > b.jobs.size) nworkers = b.jobs.size ? b.jobs.size : 1;
+    b.nworkers = nworkers;
+    b.workers = calloc (b.nworkers, sizeof *b.workers);
+
+    /* contiguous shares, so that a worker that never steals reads its files in manifest order */
+    for (size_t i = 0; i < b.nworkers; ++i)
+    {
+        batch_worker *w = &b.workers[i];
+        pthread_mutex_init (&w->lock, NULL);
+        w->batch = &b;
+        w->index = i;
+        w->head = b.jobs.size * i / b.nworkers;
+        w->tail = b.jobs.size * (i + 1) / b.nworkers;
+    }
+
+    /* the ranges of workers that could not be started are stolen by the others */
+    double start = now ();
+    size_t started = 1;
+    while (started < b.nworkers
+           && pthread_create (&b.workers[started].thread, NULL, worker_main, &b.workers[started]) == 0)
+        started++;
+    worker_main (&b.workers[0]);
+    for (size_t i = 1; i < started; ++i) pthread_join (b.workers[i].thread, NULL);
+    double elapsed = now () - start;
+
+    size_t files = 0, bytes = 0, failed = 0, stolen = 0;
+    for (size_t i = 0; i < b.nworkers; ++i)
+    {
+        batch_worker *w = &b.workers[i];
+        files += w->files;
+        bytes += w->bytes;
+        failed += w->failed;
+        stolen += w->stolen;
+        mml_song_free (&w->song);
+        mml_split_free (&w->split);
+        pthread_mutex_destroy (&w->lock);
+    }
+
+    printf ("batch:   %zu files (%zu failed), %.2f MB, %zu workers, %zu jobs stolen\n", files, failed, bytes / 1e6,
+            started, stolen);
+    printf ("batch:   %10.3f s  %10.1f files/s  %8.2f MB/s\n", elapsed, files / elapsed, bytes / 1e6 / elapsed);
+    if (b.cache)
+    {
+        mml_cache_close (b.cache);
+        mml_cache_print (b.cache, stdout);
+    }
+
+    if (compare && files > 0)
+    {
+        double single = run_single_process (&b.jobs);
+        printf ("single:  %10.3f s  %10.1f files/s  %8.2f MB/s  (batch is %.1fx faster)\n", single, files / single,
+                bytes / 1e6 / single, single / elapsed);
+    }
+
+    free (b.workers);
+    mml_arena_free (&arena);
+    return failed ? 3 : 0;
+}
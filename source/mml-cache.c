@@ -0,0 +1,403 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright (C) 2026 virtualgrub39
+
+/* On-disk cache of compiled outputs, content-addressed:
+ *
+ *   <dir>/smf/<key>.mid    whole SMFs, keyed by the hash of the source bytes
+ *   <dir>/track/<key>.trk  encoded tracks, keyed by their `mml_split_track.fingerprint`
+ *
+ * Both keys also cover CACHE_REVISION and the writer settings. A track entry is one byte of flags followed by the
+ * MTrk data, without the chunk header. Only compilations without any diagnostic are stored, so that a hit never
+ * hides a warning.
+ *
+ * Any number of processes can share a directory: entries are written to a temporary file next to their final name
+ * and renamed into place, so an entry is either absent or whole. Eviction unlinks the least recently used entries;
+ * a process that still has one open keeps reading it. It also removes the temporary files that a build which died
+ * left behind. */
+
+#define _GNU_SOURCE /* copy_file_range */
+
+#include "mml2midi.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* bump whenever the same source compiles to different bytes */
+#define CACHE_REVISION 2
+
+#define TRACK_HAS_EVENTS (1u << 0)
+
+/* a temporary file untouched for this long was left by a build that crashed or was killed */
+#define CACHE_STALE_TMP_SECONDS 3600
+
+static uint64_t
+cache_seed (void)
+{
+    const uint32_t settings[] = { CACHE_REVISION, MML_SMF_FORMAT, MML_SMF_PPQ, MML_SMF_MAX_TRACKS };
+    return mml_hash64 (settings, sizeof settings, 0);
+}
+
+static char *
+entry_path (const mml_cache *cache, const char *kind, uint64_t key, const char *extension)
+{
+    size_t size = strlen (cache->dir) + strlen (kind) + strlen (extension) + 20;
+    char *path = malloc (size);
+    snprintf (path, size, "%s/%s/%016llx%s", cache->dir, kind, (unsigned long long)key, extension);
+    return path;
+}
+
+int
+mml_cache_open (mml_cache *cache, const char *dir, size_t max_bytes)
+{
+    *cache = (mml_cache){ .dir = dir, .max_bytes = max_bytes };
+
+    static const char *const kinds[] = { "smf", "track" };
+    if (mkdir (dir, 0777) != 0 && errno != EEXIST) return -1;
+    for (size_t i = 0; i < sizeof kinds / sizeof *kinds; ++i)
+    {
+        char path[4096];
+        snprintf (path, sizeof path, "%s/%s", dir, kinds[i]);
+        if (mkdir (path, 0777) != 0 && errno != EEXIST) return -1;
+    }
+
+    return 0;
+}
+
+/* Entries are written to a temporary file next to their final name, which `entry_commit` renames into place */
+static int
+entry_create (const char *path, char **tmp)
+{
+    size_t length = strlen (path) + sizeof ".XXXXXX";
+    *tmp = malloc (length);
+    snprintf (*tmp, length, "%s.XXXXXX", path);
+
+    int fd = mkstemp (*tmp);
+    if (fd >= 0) fchmod (fd, 0644);
+    return fd;
+}
+
+static int
+entry_commit (char *tmp, const char *path, int fd, int result)
+{
+    if (fd < 0) result = -1;
+    if (fd >= 0 && close (fd) != 0) result = -1;
+    if (result == 0) result = rename (tmp, path);
+    if (result != 0 && fd >= 0) unlink (tmp);
+
+    free (tmp);
+    return result;
+}
+
+static int
+write_all (int fd, const void *data, size_t size)
+{
+    for (size_t done = 0; done < size;)
+    {
+        ssize_t n = write (fd, (const char *)data + done, size - done);
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static void
+store_track (const char *path, bool has_events, const mml_track_bytes *bytes)
+{
+    char *tmp;
+    int fd = entry_create (path, &tmp);
+    uint8_t flags = has_events ? TRACK_HAS_EVENTS : 0;
+    int result = fd < 0 ? -1 : write_all (fd, &flags, 1);
+    if (result == 0) result = write_all (fd, bytes->items, bytes->size);
+    entry_commit (tmp, path, fd, result);
+}
+
+/* Copies an entry to `out_path`. Returns 1 when there is no such entry, or it cannot be read. */
+static int
+copy_entry (const char *path, const char *out_path)
+{
+    int in = open (path, O_RDONLY | O_CLOEXEC);
+    if (in < 0) return 1;
+
+    struct stat st;
+    bool to_stdout = strcmp (out_path, "-") == 0;
+    int out = to_stdout ? STDOUT_FILENO : open (out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (out < 0 || fstat (in, &st) != 0)
+    {
+        close (in);
+        if (out >= 0 && !to_stdout) close (out);
+        return -1;
+    }
+
+    /* a reflink shares the blocks, on file systems that have them; the kernel copies everything else without a round
+     * trip through user space, unless the output is a pipe on an older kernel */
+    off_t done = 0;
+    if (!to_stdout && ioctl (out, FICLONE, in) == 0) done = st.st_size;
+    while (done < st.st_size)
+    {
+        ssize_t n = copy_file_range (in, NULL, out, NULL, st.st_size - done, 0);
+        if (n <= 0) break;
+        done += n;
+    }
+    char buffer[1 << 16];
+    while (done < st.st_size)
+    {
+        ssize_t n = pread (in, buffer, sizeof buffer, done);
+        if (n <= 0 || write (out, buffer, n) != n) break;
+        done += n;
+    }
+
+    close (in);
+    int result = done == st.st_size ? 0 : -1;
+    if (!to_stdout && close (out) != 0) result = -1;
+
+    /* the mtime is when the entry was last used, for the eviction */
+    if (result == 0) utimensat (AT_FDCWD, path, NULL, 0);
+    return result;
+}
+
+static bool
+load_track (const char *path, bool *has_events, mml_track_bytes *bytes)
+{
+    int fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    uint8_t flags;
+    bool ok = fstat (fd, &st) == 0 && st.st_size >= 1 && read (fd, &flags, 1) == 1;
+    if (ok)
+    {
+        size_t size = st.st_size - 1;
+        da_reserve (NULL, bytes, size);
+        ok = size == 0 || read (fd, bytes->items, size) == (ssize_t)size;
+        bytes->size = ok ? size : 0;
+        *has_events = flags & TRACK_HAS_EVENTS;
+    }
+    close (fd);
+
+    if (ok) utimensat (AT_FDCWD, path, NULL, 0);
+    return ok;
+}
+
+static int
+write_tracks (const char *path, const mml_track_bytes *tracks, size_t ntracks)
+{
+    int fd = strcmp (path, "-") == 0 ? STDOUT_FILENO : open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) return -1;
+
+    int result = mml_write_tracks_fd (fd, tracks, ntracks);
+    if (fd != STDOUT_FILENO && close (fd) != 0) result = -1;
+    return result;
+}
+
+static void
+print_diagnostics (const char *in_path, const mml_source *source, const mml_diagnostics *diagnostics)
+{
+    if (!diagnostics->size) return;
+
+    /* one file's diagnostics stay together, whatever other threads print */
+    flockfile (stderr);
+    mml_diagnostics_print (stderr, in_path, source->data, source->size, diagnostics);
+    funlockfile (stderr);
+}
+
+/* The whole pipeline, for sources that cannot be split */
+static int
+compile_whole (const mml_source *source, const char *in_path, const char *out_path, mml_song *song,
+               const char *smf_path)
+{
+    mml_lexer lexer;
+    if (mml_lexer_init (&lexer, source->data, source->size) != 0) return -1;
+
+    mml_song_reset (song);
+    int errors = mml_parse (&lexer, song);
+    print_diagnostics (in_path, source, &song->diagnostics);
+    if (errors > 0) return errors;
+
+    if (song->diagnostics.size == 0)
+    {
+        char *tmp;
+        int fd = entry_create (smf_path, &tmp);
+        if (entry_commit (tmp, smf_path, fd, fd < 0 ? -1 : mml_write_midi_fd (song, fd, 0)) == 0)
+        {
+            /* 1 when a concurrent build evicted the entry already: it is written from the song then */
+            int result = copy_entry (smf_path, out_path);
+            if (result <= 0) return result;
+        }
+    }
+
+    return mml_write_midi (song, out_path, 0) == 0 ? 0 : -1;
+}
+
+int
+mml_cache_compile (mml_cache *cache, const mml_source *source, const char *in_path, const char *out_path,
+                   mml_song *song, mml_split *split)
+{
+    uint64_t seed = cache_seed ();
+    char *smf_path = entry_path (cache, "smf", mml_hash64 (source->data, source->size, seed), ".mid");
+
+    /* -1 is a hit that could not be written out, and counts as neither */
+    int result = copy_entry (smf_path, out_path);
+    if (result <= 0)
+    {
+        if (result == 0) atomic_fetch_add (&cache->hits, 1);
+        free (smf_path);
+        return result;
+    }
+    atomic_fetch_add (&cache->misses, 1);
+
+    if (mml_split_source (split, source->data, source->size) != 0)
+    {
+        result = compile_whole (source, in_path, out_path, song, smf_path);
+        free (smf_path);
+        return result;
+    }
+
+    /* tracks past the last channel are still parsed, for their diagnostics, but never encoded */
+    mml_track_bytes bytes[MML_SMF_MAX_TRACKS + 1] = { 0 };
+    size_t ntracks = 0;
+    bool whole = false;
+
+    for (size_t i = 0; i < split->ntracks && !whole; ++i)
+    {
+        mml_track_bytes *out = &bytes[i < MML_SMF_MAX_TRACKS ? i : MML_SMF_MAX_TRACKS];
+        out->size = 0;
+
+        char *path = entry_path (cache, "track", mml_hash64 (&split->tracks[i].fingerprint, 8, seed), ".trk");
+        bool has_events;
+        if (load_track (path, &has_events, out))
+            atomic_fetch_add (&cache->track_hits, 1);
+        else
+        {
+            atomic_fetch_add (&cache->track_misses, 1);
+
+            /* after an error, the parser skips to the end of the track, definitions included, where the split does
+             * not: a track with anything to report is only reported right by a parse of the whole source */
+            int errors = mml_split_parse (split, i, song);
+            has_events = song->events.size > 0;
+            whole = errors != 0 || song->diagnostics.size > 0;
+            if (!whole && has_events && i < MML_SMF_MAX_TRACKS) mml_encode_track (song, 0, i, NULL, out);
+            if (!whole) store_track (path, has_events, out);
+        }
+        free (path);
+
+        /* only the last track can lack events, so the tracks written are the first ones */
+        if (has_events && i < MML_SMF_MAX_TRACKS) ntracks = i + 1;
+    }
+
+    if (whole)
+        result = compile_whole (source, in_path, out_path, song, smf_path);
+    else
+    {
+        char *tmp;
+        int fd = entry_create (smf_path, &tmp);
+        result = -1;
+        if (entry_commit (tmp, smf_path, fd, fd < 0 ? -1 : mml_write_tracks_fd (fd, bytes, ntracks)) == 0)
+            result = copy_entry (smf_path, out_path);
+        if (result != 0) result = write_tracks (out_path, bytes, ntracks);
+    }
+
+    for (size_t i = 0; i <= MML_SMF_MAX_TRACKS; ++i) free (bytes[i].items);
+    free (smf_path);
+    return result;
+}
+
+typedef struct
+{
+    char *path;
+    struct timespec used;
+    size_t size;
+} cache_entry;
+
+typedef struct
+{
+    cache_entry *items;
+    size_t size, capacity;
+} cache_entries;
+
+static int
+compare_used (const void *a, const void *b)
+{
+    const struct timespec *x = &((const cache_entry *)a)->used, *y = &((const cache_entry *)b)->used;
+    if (x->tv_sec != y->tv_sec) return x->tv_sec < y->tv_sec ? -1 : 1;
+    return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+/* Lists the entries of one kind, and removes the stale temporary files among them */
+static void
+list_entries (mml_cache *cache, const char *kind, const char *extension, cache_entries *out)
+{
+    char path[4096];
+    snprintf (path, sizeof path, "%s/%s", cache->dir, kind);
+    DIR *d = opendir (path);
+    if (!d) return;
+
+    time_t now = time (NULL);
+    for (struct dirent *e; (e = readdir (d));)
+    {
+        /* temporary files have mkstemp's suffix after the extension, and may still be being written */
+        size_t length = strlen (e->d_name);
+        bool whole = length > 4 && strcmp (e->d_name + length - 4, extension) == 0;
+        bool tmp = length > 11 && strncmp (e->d_name + length - 11, extension, 4) == 0 && e->d_name[length - 7] == '.';
+        if (!whole && !tmp) continue;
+
+        struct stat st;
+        if (fstatat (dirfd (d), e->d_name, &st, 0) != 0) continue;
+
+        if (tmp)
+        {
+            if (now - st.st_mtim.tv_sec > CACHE_STALE_TMP_SECONDS && unlinkat (dirfd (d), e->d_name, 0) == 0)
+                atomic_fetch_add (&cache->evicted, 1);
+            continue;
+        }
+
+        snprintf (path, sizeof path, "%s/%s/%s", cache->dir, kind, e->d_name);
+        cache_entry entry = { .path = strdup (path), .used = st.st_mtim, .size = st.st_size };
+        da_append (NULL, out, entry);
+    }
+
+    closedir (d);
+}
+
+int
+mml_cache_close (mml_cache *cache)
+{
+    if (!cache->max_bytes) return 0;
+
+    cache_entries entries = { 0 };
+    list_entries (cache, "smf", ".mid", &entries);
+    list_entries (cache, "track", ".trk", &entries);
+
+    size_t total = 0;
+    for (size_t i = 0; i < entries.size; ++i) total += entries.items[i].size;
+
+    /* least recently used first; an entry another build removed first is gone all the same */
+    if (entries.size > 1) qsort (entries.items, entries.size, sizeof *entries.items, compare_used);
+    for (size_t i = 0; i < entries.size && total > cache->max_bytes; ++i)
+    {
+        if (unlink (entries.items[i].path) == 0)
+            atomic_fetch_add (&cache->evicted, 1);
+        else if (errno != ENOENT)
+            continue;
+        total -= entries.items[i].size;
+    }
+
+    for (size_t i = 0; i < entries.size; ++i) free (entries.items[i].path);
+    free (entries.items);
+    return 0;
+}
+
+void
+mml_cache_print (const mml_cache *cache, FILE *out)
+{
+    size_t hits = atomic_load (&cache->hits), misses = atomic_load (&cache->misses);
+    size_t track_hits = atomic_load (&cache->track_hits), track_misses = atomic_load (&cache->track_misses);
+    fprintf (out, "cache:   %zu/%zu files hit, %zu/%zu tracks hit, %zu evicted\n", hits, hits + misses, track_hits,
+             track_hits + track_misses, atomic_load (&cache->evicted));
+}
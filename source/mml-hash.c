@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright (C) 2026 virtualgrub39
+
+/* Fast non-cryptographic 64-bit hash (multiply-fold over 16-byte blocks). */
+
+#include "mml2midi.h"
+
+#include <string.h>
+
+#define HASH_P0 0xa0761d6478bd642full
+#define HASH_P1 0xe7037ed1a0b428dbull
+#define HASH_P2 0x8ebc6af09c88c6e3ull
+#define HASH_P3 0x589965cc75374cc3ull
+
+static inline uint64_t
+hash_mix (uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t
+hash_read64 (const unsigned char *p)
+{
+    uint64_t v;
+    memcpy (&v, p, sizeof v);
+    return v;
+}
+
+uint64_t
+mml_hash64 (const void *data, size_t length, uint64_t seed)
+{
+    const unsigned char *p = data;
+    uint64_t h = seed ^ hash_mix (length ^ HASH_P0, HASH_P1);
+
+    while (length >= 16)
+    {
+        h = hash_mix (hash_read64 (p) ^ HASH_P1, hash_read64 (p + 8) ^ h);
+        p += 16;
+        length -= 16;
+    }
+
+    uint64_t a = 0, b = 0;
+    if (length >= 8)
+    {
+        a = hash_read64 (p);
+        memcpy (&b, p + 8, length - 8);
+    }
+    else
+        memcpy (&a, p, length);
+
+    h = hash_mix (a ^ HASH_P2, b ^ h ^ HASH_P3);
+    return hash_mix (h ^ HASH_P0, HASH_P1);
+}
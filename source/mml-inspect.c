@@ -0,0 +1,542 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright (C) 2026 virtualgrub39
+
+/* Inspect mode: validates SMFs and reports what their tracks hold, for checking generated files in bulk.
+ *
+ * usage: mml2midi --inspect [-q] [--strict] [-j workers] file.mid...
+ *        smfcheck [-q] [--strict] [-j workers] file.mid...
+ *
+ * Each file is mapped and walked in place, chunk by chunk, with the event decoder of midi-parser.h; nothing is
+ * copied. The files are taken a window at a time: the workers map them and check their chunks, then walk the events
+ * of all of their tracks, each worker one track at a time. A track's events can only be decoded in order, but tracks
+ * and files have nothing to do with each other. Each file is reported once all of its tracks are done, in the order
+ * the files were given.
+ *
+ * A file is valid when MThd comes first and is sound, every chunk fits in the file, MThd declares as many MTrk
+ * chunks as there are, every event decodes within its chunk (sysex and meta events cancel running status), data
+ * bytes have their top bit clear, and every track ends with exactly one end of track event. Note ons and note offs
+ * that do not pair up on their channel and key within a track are warnings: the file plays, but a note hangs or a
+ * release goes nowhere. With --strict, warnings make a file invalid too.
+ *
+ * Problems go to stderr, as `path:offset: severity: message`, in the order of their offsets; unless -q, counts of
+ * events, notes and ticks per track go to stdout. The exit status is 4 when any file is invalid. */
+
+#define _DEFAULT_SOURCE
+
+#include "mml2midi.h"
+
+/* a private copy of the decoder, for the compiler to inline into the loop over the events */
+#define MIDI_PARSER_STATIC
+#define MIDI_PARSER_IMPLEMENTATION
+#include <midi-codec/midi-parser.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INSPECT_MAX_PROBLEMS 10 /* printed per file; the rest are only counted */
+
+#define INSPECT_WINDOW_FILES 1024              /* mapped at once, at most */
+#define INSPECT_WINDOW_BYTES ((size_t)1 << 30) /* a window is closed once its files add up to this */
+
+#define META_END_OF_TRACK 0x2F
+
+typedef struct
+{
+    mml_severity severity;
+    size_t offset;
+    char *message; /* heap */
+} inspect_problem;
+
+/* The first INSPECT_MAX_PROBLEMS of each severity, which hold the first ones of the whole file */
+typedef struct
+{
+    inspect_problem *items;
+    size_t size, capacity;
+    size_t errors, warnings; /* all of them, kept or not */
+} inspect_problems;
+
+typedef struct
+{
+    const uint8_t *data; /* the chunk's, in the mapping */
+    uint32_t size;
+    size_t base; /* offset of `data` in the file */
+    size_t index;
+
+    uint64_t events, notes, ticks;
+    uint16_t channels; /* one bit per channel used */
+    inspect_problems problems;
+} inspect_track;
+
+typedef struct
+{
+    inspect_track *items;
+    size_t size, capacity;
+} inspect_tracks;
+
+typedef struct
+{
+    const char *path;
+    int error; /* errno, when it could not be read */
+    const uint8_t *data;
+    size_t size;
+
+    bool header; /* whether MThd could be read */
+    uint16_t format, ntracks, division;
+    inspect_tracks tracks; /* heap */
+    inspect_problems problems;
+} inspect_file;
+
+/* The files being inspected, and the next file or track a worker takes */
+typedef struct
+{
+    inspect_file *files;
+    size_t nfiles;
+    inspect_track **tracks; /* heap, into the files' */
+    size_t ntracks;
+    atomic_size_t next;
+} inspect_window;
+
+static double
+now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+report (inspect_problems *problems, mml_severity severity, size_t offset, const char *format, va_list args)
+{
+    size_t *count = severity == MML_SEVERITY_ERROR ? &problems->errors : &problems->warnings;
+    if ((*count)++ >= INSPECT_MAX_PROBLEMS) return;
+
+    va_list copy;
+    va_copy (copy, args);
+    int length = vsnprintf (NULL, 0, format, copy);
+    va_end (copy);
+
+    char *message = malloc (length + 1);
+    vsnprintf (message, length + 1, format, args);
+
+    inspect_problem problem = { .severity = severity, .offset = offset, .message = message };
+    da_append (NULL, problems, problem);
+}
+
+__attribute__ ((format (printf, 3, 4))) static void
+error (inspect_problems *problems, size_t offset, const char *format, ...)
+{
+    va_list args;
+    va_start (args, format);
+    report (problems, MML_SEVERITY_ERROR, offset, format, args);
+    va_end (args);
+}
+
+__attribute__ ((format (printf, 3, 4))) static void
+warning (inspect_problems *problems, size_t offset, const char *format, ...)
+{
+    va_list args;
+    va_start (args, format);
+    report (problems, MML_SEVERITY_WARNING, offset, format, args);
+    va_end (args);
+}
+
+static uint32_t
+read_u32 (const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint16_t
+read_u16 (const uint8_t *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+/* Why `track_event_next` could not decode the event at `at`, which it leaves in place */
+static const char *
+undecodable (const track_parser_t *p, uint32_t at)
+{
+    uint32_t delta;
+    int n = midi_vlq_decode (p->bytes + at, p->len - at, &delta);
+    if (n <= 0) return "delta time is cut short or longer than 5 bytes";
+    if (at + n == p->len) return "delta time without an event";
+
+    uint8_t status = p->bytes[at + n];
+    if (status < 0x80) return "data byte without a running status";
+    if (status > 0xF0 && status != 0xF7 && status != 0xFF) return "system message, which an SMF cannot hold";
+    return "event runs past the end of the track";
+}
+
+static void
+inspect_events (inspect_track *t)
+{
+    const uint8_t *data = t->data;
+    uint32_t size = t->size;
+    size_t base = t->base, track = t->index;
+    inspect_problems *problems = &t->problems;
+    uint16_t sounding[16][128] = { 0 }; /* note ons not matched yet, per channel and key */
+    bool ended = false;
+
+    track_parser_t p = { .bytes = data, .len = size };
+    track_event_t e;
+    while (p.idx < p.len)
+    {
+        uint32_t at = p.idx;
+        if (ended)
+        {
+            error (problems, base + at, "track %zu: %u bytes after its end of track", track, size - at);
+            break;
+        }
+
+        int n = track_event_next (&p, &e);
+        if (n < 0)
+        {
+            error (problems, base + at, "track %zu: %s", track, undecodable (&p, at));
+            break;
+        }
+
+        t->events += 1;
+        t->ticks += e.delta;
+
+        switch (e.kind)
+        {
+        case EV_MIDI: {
+            /* the decoder takes data bytes as they come: the one or two that follow the status, if there is one */
+            const uint8_t *bytes = data + p.idx - n;
+            int first = bytes[0] >= 0x80;
+            if ((bytes[n - 1] | (n - first == 2 ? bytes[n - 2] : 0)) & 0x80)
+                for (int i = first; i < n; ++i)
+                    if (bytes[i] >= 0x80)
+                        error (problems, base + (bytes + i - data), "track %zu: data byte %#x has its top bit set",
+                               track, bytes[i]);
+
+            const midi_event_t *m = &e.as.midi;
+            uint16_t *count = &sounding[m->channel][m->as.note_on.note & 0x7F];
+            t->channels |= 1u << m->channel;
+            if (m->kind == MIDI_NOTE_ON && m->as.note_on.velocity)
+            {
+                t->notes += 1;
+                *count += 1;
+            }
+            else if (m->kind == MIDI_NOTE_ON || m->kind == MIDI_NOTE_OFF)
+            {
+                if (*count)
+                    *count -= 1;
+                else
+                    warning (problems, base + (bytes - data),
+                             "track %zu: note off without a note on, channel %u key %u", track, m->channel,
+                             m->as.note_off.note);
+            }
+            break;
+        }
+        case EV_META:
+            if (e.as.meta.type != META_END_OF_TRACK) break;
+            ended = true;
+            if (e.as.meta.length)
+                error (problems, base + at, "track %zu: end of track holds %u bytes of data", track,
+                       e.as.meta.length);
+            break;
+        case EV_SYSEX: break;
+        }
+    }
+
+    if (!ended && p.idx == p.len) error (problems, base + size, "track %zu: no end of track", track);
+
+    size_t left = 0;
+    for (size_t c = 0; c < 16; ++c)
+        for (size_t k = 0; k < 128; ++k) left += sounding[c][k];
+    if (left)
+        warning (problems, base + size, "track %zu: %zu note%s still on at its end", track, left,
+                 left == 1 ? "" : "s");
+}
+
+/* Checks MThd and the chunks, and lists the tracks for `inspect_events` */
+static void
+inspect_chunks (inspect_file *f)
+{
+    const uint8_t *data = f->data;
+    size_t size = f->size;
+    inspect_problems *problems = &f->problems;
+
+    if (size < 8 || memcmp (data, "MThd", 4) != 0)
+    {
+        error (problems, 0, "not an SMF, it does not start with an MThd chunk");
+        return;
+    }
+
+    uint32_t length = read_u32 (data + 4);
+    if (length < 6 || length > size - 8)
+    {
+        error (problems, 4, "MThd length %u, where at least 6 and at most %zu fit", length, size - 8);
+        return;
+    }
+
+    f->header = true;
+    f->format = read_u16 (data + 8), f->ntracks = read_u16 (data + 10), f->division = read_u16 (data + 12);
+    if (f->format > 2) error (problems, 8, "format %u, where only 0, 1 and 2 exist", f->format);
+    if (f->division == 0) error (problems, 12, "0 ticks per quarter note");
+
+    size_t offset = 8 + length;
+    while (offset < size)
+    {
+        if (size - offset < 8)
+        {
+            error (problems, offset, "%zu bytes after the last chunk, too few for a chunk", size - offset);
+            break;
+        }
+
+        const uint8_t *chunk = data + offset;
+        length = read_u32 (chunk + 4);
+        if (length > size - offset - 8)
+        {
+            error (problems, offset + 4, "chunk length %u runs past the end of the file, %zu bytes on", length,
+                   size - offset - 8);
+            break;
+        }
+
+        /* chunks of other types are skipped, as the standard asks */
+        if (memcmp (chunk, "MTrk", 4) == 0)
+        {
+            inspect_track t = { .data = chunk + 8, .size = length, .base = offset + 8, .index = f->tracks.size };
+            da_append (NULL, &f->tracks, t);
+        }
+        else if (memcmp (chunk, "MThd", 4) == 0)
+            error (problems, offset, "a second MThd chunk");
+
+        offset += 8 + length;
+    }
+
+    size_t mtrk = f->tracks.size;
+    if (mtrk != f->ntracks) error (problems, 10, "MThd declares %u tracks, the file has %zu", f->ntracks, mtrk);
+    if (f->format == 0 && mtrk > 1) error (problems, 8, "format 0 with %zu tracks, where it holds one", mtrk);
+}
+
+static void
+map_file (inspect_file *f)
+{
+    struct stat st;
+    int fd = open (f->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat (fd, &st) != 0 || (S_ISDIR (st.st_mode) && (errno = EISDIR)))
+    {
+        f->error = errno;
+        if (fd >= 0) close (fd);
+        return;
+    }
+
+    /* an empty file cannot be mapped, and is not an SMF either */
+    f->size = st.st_size;
+    if (f->size > 0)
+    {
+        void *data = mmap (NULL, f->size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (data == MAP_FAILED)
+            f->error = errno;
+        else
+            f->data = data;
+    }
+    close (fd);
+
+    if (!f->error) inspect_chunks (f);
+}
+
+static void *
+chunks_worker (void *arg)
+{
+    inspect_window *w = arg;
+    for (size_t i; (i = atomic_fetch_add (&w->next, 1)) < w->nfiles;) map_file (&w->files[i]);
+    return NULL;
+}
+
+static void *
+events_worker (void *arg)
+{
+    inspect_window *w = arg;
+    for (size_t i; (i = atomic_fetch_add (&w->next, 1)) < w->ntracks;) inspect_events (w->tracks[i]);
+    return NULL;
+}
+
+/* Runs `worker` on this thread and up to `threads - 1` others, until it has taken every file or track */
+static void
+run (void *(*worker) (void *), inspect_window *w, pthread_t *workers, size_t threads)
+{
+    atomic_store (&w->next, 0);
+
+    size_t started = 0;
+    while (started + 1 < threads && pthread_create (&workers[started], NULL, worker, w) == 0) started++;
+    worker (w);
+    for (size_t i = 0; i < started; ++i) pthread_join (workers[i], NULL);
+}
+
+static int
+compare_problems (const void *a, const void *b)
+{
+    const inspect_problem *x = *(const inspect_problem *const *)a, *y = *(const inspect_problem *const *)b;
+    if (x->offset != y->offset) return (x->offset > y->offset) - (x->offset < y->offset);
+    return (x > y) - (x < y); /* as they were reported: the kept problems are gathered in that order */
+}
+
+static void
+gather (const inspect_problem ***all, size_t *size, inspect_problems *problems, size_t *errors, size_t *warnings)
+{
+    for (size_t i = 0; i < problems->size; ++i) (*all)[(*size)++] = &problems->items[i];
+    *errors += problems->errors;
+    *warnings += problems->warnings;
+}
+
+static void
+free_problems (inspect_problems *problems)
+{
+    for (size_t i = 0; i < problems->size; ++i) free (problems->items[i].message);
+    free (problems->items);
+}
+
+/* Prints what was found in the file, then lets it go; returns its problems in `errors` and `warnings` */
+static void
+print_file (inspect_file *f, bool quiet, size_t *errors, size_t *warnings)
+{
+    if (f->error)
+    {
+        fprintf (stderr, "%s: %s\n", f->path, strerror (f->error));
+        return;
+    }
+
+    if (!quiet && f->header)
+    {
+        printf ("%s: format %u, %u tracks, ", f->path, f->format, f->ntracks);
+        if (f->division & 0x8000)
+            printf ("%d frames per second, %u ticks per frame\n", -(int8_t)(f->division >> 8), f->division & 0xFF);
+        else
+            printf ("%u ticks per quarter note\n", f->division);
+
+        for (size_t i = 0; i < f->tracks.size; ++i)
+        {
+            const inspect_track *t = &f->tracks.items[i];
+            printf ("  track %zu: %llu events, %llu notes, %llu ticks, %d channels\n", i,
+                    (unsigned long long)t->events, (unsigned long long)t->notes, (unsigned long long)t->ticks,
+                    __builtin_popcount (t->channels));
+        }
+    }
+
+    size_t kept = f->problems.size;
+    for (size_t i = 0; i < f->tracks.size; ++i) kept += f->tracks.items[i].problems.size;
+
+    const inspect_problem **all = malloc (kept * sizeof *all + 1);
+    size_t size = 0;
+    *errors = *warnings = 0;
+    gather (&all, &size, &f->problems, errors, warnings);
+    for (size_t i = 0; i < f->tracks.size; ++i) gather (&all, &size, &f->tracks.items[i].problems, errors, warnings);
+    qsort (all, size, sizeof *all, compare_problems);
+
+    size_t printed[2] = { 0 };
+    for (size_t i = 0; i < size; ++i)
+    {
+        const inspect_problem *p = all[i];
+        if (printed[p->severity]++ >= INSPECT_MAX_PROBLEMS) continue;
+        fprintf (stderr, "%s:%#zx: %s: %s\n", f->path, p->offset,
+                 p->severity == MML_SEVERITY_ERROR ? "error" : "warning", p->message);
+    }
+    if (*errors > INSPECT_MAX_PROBLEMS)
+        fprintf (stderr, "%s: %zu more errors\n", f->path, *errors - INSPECT_MAX_PROBLEMS);
+    if (*warnings > INSPECT_MAX_PROBLEMS)
+        fprintf (stderr, "%s: %zu more warnings\n", f->path, *warnings - INSPECT_MAX_PROBLEMS);
+
+    free (all);
+}
+
+static void
+release_file (inspect_file *f)
+{
+    if (f->data) munmap ((void *)f->data, f->size);
+    free_problems (&f->problems);
+    for (size_t i = 0; i < f->tracks.size; ++i) free_problems (&f->tracks.items[i].problems);
+    free (f->tracks.items);
+}
+
+static void
+usage (void)
+{
+    fprintf (stderr, "usage: mml2midi --inspect [-q] [--strict] [-j workers] file.mid...\n"
+                     "       smfcheck [-q] [--strict] [-j workers] file.mid...\n");
+}
+
+int
+mml_inspect_main (int argc, char *argv[])
+{
+    bool quiet = false, strict = false;
+    long threads = sysconf (_SC_NPROCESSORS_ONLN);
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-' && argv[arg][1]; ++arg)
+    {
+        if (strcmp (argv[arg], "-q") == 0)
+            quiet = true;
+        else if (strcmp (argv[arg], "--strict") == 0)
+            strict = true;
+        else if (strcmp (argv[arg], "-j") == 0 && arg + 1 < argc)
+            threads = strtol (argv[++arg], NULL, 10);
+        else
+        {
+            usage ();
+            return 1;
+        }
+    }
+    if (arg == argc)
+    {
+        usage ();
+        return 1;
+    }
+    if (threads < 1) threads = 1;
+
+    size_t files = argc - arg, invalid = 0, warned = 0, unreadable = 0, bytes = 0;
+    inspect_file *window = calloc (INSPECT_WINDOW_FILES, sizeof *window);
+    pthread_t *workers = calloc (threads, sizeof *workers);
+    double start = now ();
+
+    while (arg < argc)
+    {
+        /* as many files as fit the window, and at least one; files that cannot be read are reported later */
+        inspect_window w = { .files = window };
+        for (size_t size = 0; arg < argc && w.nfiles < INSPECT_WINDOW_FILES && size < INSPECT_WINDOW_BYTES;)
+        {
+            struct stat st;
+            if (stat (argv[arg], &st) == 0) size += st.st_size;
+            w.files[w.nfiles++] = (inspect_file){ .path = argv[arg++] };
+        }
+        run (chunks_worker, &w, workers, threads);
+
+        for (size_t i = 0; i < w.nfiles; ++i) w.ntracks += w.files[i].tracks.size;
+        w.tracks = malloc (w.ntracks * sizeof *w.tracks + 1);
+        size_t ntracks = 0;
+        for (size_t i = 0; i < w.nfiles; ++i)
+            for (size_t k = 0; k < w.files[i].tracks.size; ++k) w.tracks[ntracks++] = &w.files[i].tracks.items[k];
+        run (events_worker, &w, workers, threads);
+        free (w.tracks);
+
+        for (size_t i = 0; i < w.nfiles; ++i)
+        {
+            inspect_file *f = &w.files[i];
+            size_t errors = 0, warnings = 0;
+            print_file (f, quiet, &errors, &warnings);
+            unreadable += f->error != 0;
+            invalid += !f->error && (errors > 0 || (strict && warnings > 0));
+            warned += warnings > 0;
+            bytes += f->size;
+            release_file (f);
+        }
+    }
+
+    double elapsed = now () - start;
+    if (files > 1)
+        fprintf (stderr, "mml: %zu files, %zu invalid, %zu with warnings, %.1f MB checked at %.2f GB/s\n", files,
+                 invalid + unreadable, warned, bytes / 1e6, elapsed > 0 ? bytes / elapsed / 1e9 : 0.0);
+
+    free (workers);
+    free (window);
+    if (unreadable) return 2;
+    return invalid ? 4 : 0;
+}
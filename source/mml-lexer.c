@@ -3,7 +3,8 @@
 
 #include "mml2midi.h"
 
-#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
 #include <string.h>
 
 static int
@@ -16,62 +17,104 @@ utf8_char_len (unsigned char c)
     return 1;                         /* Fallback (invalid or continuation byte) */
 }
 
-static bool
-is_space (char c)
-{
-    return isspace (c);
-}
+/* Character classes and token kinds of every byte, in one lookup. Built at compile time from plain byte comparisons,
+ * so classification does not depend on the locale of the embedding process. */
+
+#define CC_KIND(c)                                                                                                     \
+    (((c) >= 'a' && (c) <= 'g') || (c) == 'r' ? MML_NOTE                                                               \
+     : (c) == 'o' || (c) == '<' || (c) == '>' || (c) == 'l' || (c) == 'v' || (c) == 't' ? MML_COMMAND                  \
+     : (c) == '+' ? MML_PLUS                                                                                           \
+     : (c) == '-' ? MML_MINUS                                                                                          \
+     : (c) == '.' ? MML_DOT                                                                                            \
+     : (c) == ';' ? MML_SCOLON                                                                                         \
+     : (c) == '}' ? MML_RBRACE                                                                                         \
+     : (c) == '{' ? MML_LBRACE                                                                                         \
+     : (c) == ']' ? MML_RBRACKET                                                                                       \
+     : (c) == '[' ? MML_LBRACKET                                                                                       \
+     : (c) == '(' ? MML_LPAREN                                                                                         \
+     : (c) == ')' ? MML_RPAREN                                                                                         \
+     : (c) == '&' ? MML_AMP                                                                                            \
+     : (c) == ':' ? MML_COLON                                                                                          \
+     : (c) == '@' ? MML_EXPANSION                                                                                      \
+     : (c) == '!' ? MML_DEFINITION                                                                                     \
+     : (c) >= '0' && (c) <= '9' ? MML_NUMBER                                                                           \
+     : MML_UNKNOWN)
+
+#define CC_FLAGS(c)                                                                                                    \
+    (((c) == ' ' || ((c) >= '\t' && (c) <= '\r') ? MML_CC_SPACE : 0)                                                   \
+     | ((c) == '\n' || (c) == '\r' ? MML_CC_NEWLINE : 0)                                                               \
+     | ((c) >= '0' && (c) <= '9' ? MML_CC_DIGIT : 0)                                                                   \
+     | (((c) >= '0' && (c) <= '9') || ((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || (c) >= 0x80          \
+                || (c) == '_'                                                                                          \
+            ? MML_CC_IDENT                                                                                             \
+            : 0)                                                                                                       \
+     | ((c) == '%' ? MML_CC_COMMENT : 0))
+
+#define CC(c) { .kind = CC_KIND (c), .flags = CC_FLAGS (c) }
+#define CC4(c) CC (c), CC ((c) + 1), CC ((c) + 2), CC ((c) + 3)
+#define CC16(c) CC4 (c), CC4 ((c) + 4), CC4 ((c) + 8), CC4 ((c) + 12)
+#define CC64(c) CC16 (c), CC16 ((c) + 16), CC16 ((c) + 32), CC16 ((c) + 48)
+
+const mml_char_class mml_char_table[256] = { CC64 (0), CC64 (64), CC64 (128), CC64 (192) };
 
-static bool
-is_digit (char c)
+static void
+skip_whitespace (mml_lexer *lexer)
 {
-    return isdigit (c);
+    /* most tokens are separated by a single space at most, don't enter the scanner for those */
+    if (lexer->offset < lexer->size && (mml_char_table[(unsigned char)lexer->data[lexer->offset]].flags & MML_CC_SPACE))
+        lexer->offset = mml_scan_space (lexer->data, lexer->offset + 1, lexer->size);
 }
 
-static bool
-is_ident_char (char c)
+static void
+skip_comment (mml_lexer *lexer)
 {
-    unsigned char uc = (unsigned char)c;
-    return isalnum (uc) || (uc >= 0x80) || uc == '_';
+    if (lexer->data[lexer->offset] != '%') return;
+    lexer->offset = mml_scan_newline (lexer->data, lexer->offset, lexer->size);
 }
 
-static bool
-is_newline (char c)
+int
+mml_lexer_init (mml_lexer *lexer, const char *source, size_t length)
 {
-    return c == '\r' || c == '\n';
-}
+    *lexer = (mml_lexer){ .data = source, .offset = 0, .size = 0 };
 
-typedef struct
-{
-    size_t offset, size;
-    const char *data;
-} mmlexer;
+    if (length > UINT32_MAX)
+    {
+        errno = EFBIG;
+        return -1;
+    }
 
-static void
-skip_whitespace (mmlexer *lexer)
-{
-    while (lexer->offset < lexer->size && is_space (lexer->data[lexer->offset])) lexer->offset += 1;
+    lexer->size = length;
+    return 0;
 }
 
-static void
-skip_comment (mmlexer *lexer)
+static uint32_t
+decode_number (const char *digits, size_t length)
 {
-    if (lexer->data[lexer->offset] != '%') return;
-    while (lexer->offset < lexer->size && !is_newline (lexer->data[lexer->offset])) lexer->offset++;
+    uint32_t value = 0;
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        uint32_t d = digits[i] - '0';
+        if (value > (UINT32_MAX - 1 - d) / 10) return MML_NUMBER_OVERFLOW;
+        value = value * 10 + d;
+    }
+
+    return value;
 }
 
-static token
-read_next_token (mmlexer *lexer)
+token
+mml_read_next_token (mml_lexer *lexer)
 {
     size_t u8char_len;
     token tok;
 
-    if (lexer == NULL) return (token){ MML_UNKNOWN, { 0 } };
+    if (lexer == NULL) return (token){ .kind = MML_UNKNOWN };
 
     for (;;)
     {
         skip_whitespace (lexer);
-        if (lexer->offset < lexer->size && lexer->data[lexer->offset] == '%')
+        if (lexer->offset < lexer->size
+            && (mml_char_table[(unsigned char)lexer->data[lexer->offset]].flags & MML_CC_COMMENT))
             skip_comment (lexer);
         else
             break;
@@ -79,116 +122,102 @@ read_next_token (mmlexer *lexer)
 
     size_t offset = lexer->offset;
 
-    if (offset == lexer->size) return (token){ MML_EOF, { 0 } };
+    if (offset == lexer->size) return (token){ .kind = MML_EOF, .offset = offset };
 
-    u8char_len = utf8_char_len (lexer->data[offset]);
+    unsigned char c = lexer->data[offset];
+    mml_char_class cc = mml_char_table[c];
+
+    u8char_len = c < 0x80 ? 1 : utf8_char_len (c);
     if (offset + u8char_len > lexer->size) u8char_len = lexer->size - offset;
 
-    tok.kind = MML_UNKNOWN;
-    tok.view = (string_view){ lexer->data + lexer->offset, u8char_len };
+    tok = (token){ .kind = cc.kind, .offset = offset, .length = u8char_len };
 
-    switch (lexer->data[offset])
+    switch (cc.kind)
     {
-    case 'a' ... 'g':
-    case 'r': tok.kind = MML_NOTE; break;
-    case 'o':
-    case '<':
-    case '>':
-    case 'l':
-    case 'v':
-    case 't': tok.kind = MML_COMMAND; break;
-    case '+': tok.kind = MML_PLUS; break;
-    case '-': tok.kind = MML_MINUS; break;
-    case '.': tok.kind = MML_DOT; break;
-    case ';': tok.kind = MML_SCOLON; break;
-    case '}': tok.kind = MML_RBRACE; break;
-    case '{': tok.kind = MML_LBRACE; break;
-    case ']': tok.kind = MML_RBRACKET; break;
-    case '[': tok.kind = MML_LBRACKET; break;
-    case '(': tok.kind = MML_LPAREN; break;
-    case ')': tok.kind = MML_RPAREN; break;
-    case '&': tok.kind = MML_AMP; break;
-    case ':': tok.kind = MML_COLON; break;
-
-    case '@': {
-        size_t length = 1;
-        char c = lexer->data[offset + length];
-        while (offset + length < lexer->size && is_ident_char (c))
-        {
-            length += 1;
-            c = lexer->data[offset + length];
-        }
-
-        tok.kind = MML_EXPANSION;
-        tok.view.size = length;
-
+    case MML_EXPANSION:
+    /* identifier characters never include whitespace nor '{' */
+    case MML_DEFINITION: tok.length = mml_scan_ident (lexer->data, offset + 1, lexer->size) - offset; break;
+    case MML_NUMBER:
+        tok.length = mml_scan_digits (lexer->data, offset, lexer->size) - offset;
+        tok.value = decode_number (lexer->data + offset, tok.length);
         break;
+    default: break;
     }
 
-    case '!': {
-        size_t length = 1;
-        char c = lexer->data[offset + length];
-        while (offset + length < lexer->size && is_ident_char (c) && !is_space (c) && c != '{')
-        {
-            length += 1;
-            c = lexer->data[offset + length];
-        }
-
-        tok.kind = MML_DEFINITION;
-        tok.view.size = length;
-
-        break;
-    }
+    lexer->offset += tok.length;
+    return tok;
+}
 
-    default: {
-        if (is_digit (lexer->data[offset]))
-        {
-            size_t length = 0;
-            char c = lexer->data[offset + length];
-            while (offset + length < lexer->size && is_digit (c))
-            {
+static bool
+stream_reserve (mml_token_stream *stream, size_t new_cap)
+{
+    if (new_cap <= stream->capacity) return true;
 
-                length += 1;
-                c = lexer->data[offset + length];
-            }
+    size_t capacity = stream->capacity ? stream->capacity : DA_INIT_CAPACITY;
+    while (new_cap > capacity) capacity *= 2;
+    MML_STAT_ADD (reallocs, 1);
 
-            tok.kind = MML_NUMBER;
-            tok.view.size = length;
+    uint8_t *kinds = realloc (stream->kinds, capacity * sizeof *kinds);
+    if (kinds) stream->kinds = kinds;
+    uint32_t *offsets = realloc (stream->offsets, capacity * sizeof *offsets);
+    if (offsets) stream->offsets = offsets;
+    uint32_t *lengths = realloc (stream->lengths, capacity * sizeof *lengths);
+    if (lengths) stream->lengths = lengths;
+    uint32_t *values = realloc (stream->values, capacity * sizeof *values);
+    if (values) stream->values = values;
 
-            break;
-        }
-    }
-    }
+    if (!kinds || !offsets || !lengths || !values) return false;
 
-    lexer->offset += tok.view.size;
-    return tok;
+    stream->capacity = capacity;
+    return true;
 }
 
-token *
-mml_tokenize (const char *source, size_t length)
+int
+mml_tokenize (const char *source, size_t length, mml_token_stream *out_stream)
 {
-    if (!source) return NULL;
+    if (!source || !out_stream)
+    {
+        errno = EINVAL;
+        return -1;
+    }
     if (length == 0) length = strlen (source);
 
-    token t;
-    mmlexer lexer = {
-        .data = source,
-        .offset = 0,
-        .size = length,
-    };
+    mml_lexer lexer;
+    if (mml_lexer_init (&lexer, source, length) != 0) return -1;
 
-    struct
-    {
-        token *items;
-        size_t capacity, size;
-    } tokens = { 0 };
+    *out_stream = (mml_token_stream){ 0 };
 
     for (;;)
     {
-        t = read_next_token (&lexer);
-        da_append (&tokens, t);
+        token t = mml_read_next_token (&lexer);
+
+        if (!stream_reserve (out_stream, out_stream->size + 1))
+        {
+            mml_token_stream_free (out_stream);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        out_stream->kinds[out_stream->size] = t.kind;
+        out_stream->offsets[out_stream->size] = t.offset;
+        out_stream->lengths[out_stream->size] = t.length;
+        out_stream->values[out_stream->size] = t.value;
+        out_stream->size += 1;
+
         if (t.kind == MML_EOF) break;
     }
 
-    return tokens.items;
+    return 0;
+}
+
+void
+mml_token_stream_free (mml_token_stream *stream)
+{
+    if (!stream) return;
+
+    free (stream->kinds);
+    free (stream->offsets);
+    free (stream->lengths);
+    free (stream->values);
+    *stream = (mml_token_stream){ 0 };
 }
@@ -0,0 +1,520 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright (C) 2026 virtualgrub39
+
+#include "mml2midi.h"
+
+#include <string.h>
+#include <uchar.h>
+
+/* Notes are looked up rather than computed: by letter (0 for rests and anything else), accidental and octave. From
+ * octave 10 up every note is clamped to 127, and the octave is taken as unsigned, the way it always was, so that
+ * going below octave 0 wraps into the clamped range too. */
+#define NOTE_REST 0xFF
+#define NOTE_OCTAVES 11
+
+static const uint8_t pitch_letters[256] = {
+    ['c'] = 1, ['d'] = 2, ['e'] = 3, ['f'] = 4, ['g'] = 5, ['a'] = 6, ['b'] = 7,
+    ['C'] = 1, ['D'] = 2, ['E'] = 3, ['F'] = 4, ['G'] = 5, ['A'] = 6, ['B'] = 7,
+};
+
+#define NOTE(octave, base, acc) ((octave + 1) * 12 + base + acc > 127 ? 127 : (octave + 1) * 12 + base + acc)
+#define LETTER(octave, base) { NOTE (octave, base, -1), NOTE (octave, base, 0), NOTE (octave, base, 1) }
+#define OCTAVE(o)                                                                                                      \
+    {                                                                                                                  \
+        { NOTE_REST, NOTE_REST, NOTE_REST }, LETTER (o, 0), LETTER (o, 2), LETTER (o, 4), LETTER (o, 5),               \
+            LETTER (o, 7), LETTER (o, 9), LETTER (o, 11)                                                               \
+    }
+
+static const uint8_t midi_notes[NOTE_OCTAVES][8][3] = {
+    OCTAVE (0), OCTAVE (1), OCTAVE (2), OCTAVE (3), OCTAVE (4),  OCTAVE (5),
+    OCTAVE (6), OCTAVE (7), OCTAVE (8), OCTAVE (9), OCTAVE (10),
+};
+
+#undef OCTAVE
+#undef LETTER
+#undef NOTE
+
+static inline uint8_t
+midi_note (uint8_t pitch, uint8_t octave, int accidental)
+{
+    return midi_notes[octave < NOTE_OCTAVES ? octave : NOTE_OCTAVES - 1][pitch_letters[pitch]][accidental + 1];
+}
+
+static uint32_t
+calculate_duration (uint32_t length, uint32_t dots, uint32_t ticks_per_quarter)
+{
+    if (length == 0) return 0;
+
+    uint32_t base_ticks = (4 * ticks_per_quarter) / length;
+
+    uint32_t total_ticks = base_ticks;
+    uint32_t dot_add = base_ticks;
+
+    for (uint32_t i = 0; i < dots; i++)
+    {
+        dot_add /= 2;
+        total_ticks += dot_add;
+    }
+
+    return total_ticks;
+}
+
+/* Durations of the lengths and dots that scores actually use, for the default 480 PPQ; any other resolution gets its
+ * own table when a track is lowered, and anything outside the table goes through `calculate_duration`. Each dot adds
+ * half of the previous addition, rounded down, which is the same as base / 2^n. */
+#define DURATION_LENGTHS 65
+#define DURATION_DOTS 4
+#define DURATION_PPQ 480
+
+typedef uint32_t duration_table[DURATION_LENGTHS][DURATION_DOTS];
+
+#define BASE(length) ((length) ? 4 * DURATION_PPQ / (length) : 0)
+#define DURATIONS(l)                                                                                                   \
+    {                                                                                                                  \
+        BASE (l), BASE (l) + BASE (l) / 2, BASE (l) + BASE (l) / 2 + BASE (l) / 4,                                     \
+            BASE (l) + BASE (l) / 2 + BASE (l) / 4 + BASE (l) / 8                                                      \
+    }
+#define DURATIONS8(l)                                                                                                  \
+    DURATIONS (l), DURATIONS (l + 1), DURATIONS (l + 2), DURATIONS (l + 3), DURATIONS (l + 4), DURATIONS (l + 5),      \
+        DURATIONS (l + 6), DURATIONS (l + 7)
+
+static const duration_table durations_480 = {
+    DURATIONS8 (0),  DURATIONS8 (8),  DURATIONS8 (16), DURATIONS8 (24), DURATIONS8 (32),
+    DURATIONS8 (40), DURATIONS8 (48), DURATIONS8 (56), DURATIONS (64),
+};
+
+#undef DURATIONS8
+#undef DURATIONS
+#undef BASE
+
+static void
+build_durations (duration_table table, uint32_t ticks_per_quarter)
+{
+    for (uint32_t length = 0; length < DURATION_LENGTHS; ++length)
+        for (uint32_t dots = 0; dots < DURATION_DOTS; ++dots)
+            table[length][dots] = calculate_duration (length, dots, ticks_per_quarter);
+}
+
+typedef struct
+{
+    const mml_event *items;
+    size_t offset;
+} event_cursor;
+
+typedef struct
+{
+    mml_timeline *out;
+    const mml_song *song;
+    event_cursor at; /* next event */
+
+    /* return points of the macro bodies being played, innermost last */
+    struct
+    {
+        event_cursor *items;
+        size_t size, capacity;
+    } calls;
+
+    /* loops being played, innermost last */
+    struct
+    {
+        struct
+        {
+            size_t begin;       /* first event of the body */
+            uint32_t remaining; /* passes left, including the current one */
+        } *items;
+        size_t size, capacity;
+    } loops;
+
+    mml_arena *arena; /* backs both stacks and `out` */
+
+    /* chunked lowering: `out` is handed to `sink` and emptied whenever it holds `chunk` events */
+    mml_timeline_sink sink;
+    void *sink_user;
+    size_t chunk;
+    size_t flushed; /* events handed to the sink so far */
+
+    uint32_t ticks_per_quarter;
+    const uint32_t (*durations)[DURATION_DOTS]; /* `durations_480` or `own_durations` */
+    duration_table own_durations;
+    size_t current_tick;
+    uint32_t position; /* tick of the latest event on the timeline */
+    uint32_t default_length;
+    int octave;
+    uint8_t velocity;
+
+    size_t active_notes[128]; /* 1 + index in the track of the MML_TIMELINE_NOTE_ON of each sounding note, or 0 */
+} lower_context;
+
+static void
+ctx_reset (lower_context *ctx, uint32_t ticks_per_quarter)
+{
+    ctx->ticks_per_quarter = ticks_per_quarter;
+    if (ticks_per_quarter == DURATION_PPQ)
+        ctx->durations = durations_480;
+    else
+    {
+        build_durations (ctx->own_durations, ticks_per_quarter);
+        ctx->durations = (const uint32_t (*)[DURATION_DOTS])ctx->own_durations;
+    }
+    ctx->current_tick = 0;
+    ctx->position = 0;
+    ctx->default_length = 4; /* Quarter note */
+    ctx->octave = 4;         /* Middle octave */
+    ctx->velocity = 100;     /* Default velocity */
+}
+
+/* Appends an event `delta` ticks after the latest one */
+static void
+place (lower_context *ctx, uint32_t delta, mml_timeline_kind kind, uint8_t note, uint8_t velocity, uint32_t value)
+{
+    mml_timeline *out = ctx->out;
+    if (out->size == ctx->chunk)
+    {
+        ctx->sink (ctx->sink_user, out->items, out->size);
+        ctx->flushed += out->size;
+        out->size = 0;
+    }
+    da_reserve (ctx->arena, out, out->size + 1);
+
+    ctx->position += delta;
+    out->items[out->size++] = (mml_timeline_event){
+        .tick = ctx->position,
+        .value = value,
+        .kind = kind,
+        .note = note,
+        .velocity = velocity,
+    };
+}
+
+static void
+process_control (lower_context *ctx, char32_t cmd, unsigned arg)
+{
+    switch (cmd)
+    {
+    case 't': place (ctx, 0, MML_TIMELINE_TEMPO, 0, 0, 60000000 / arg); break;
+    case 'o': ctx->octave = arg; break;
+    case 'v': ctx->velocity = arg % 127; break;
+    case 'l': ctx->default_length = arg; break;
+    case '>': ctx->octave += 1; break;
+    case '<': ctx->octave -= 1; break;
+    default: abort ();
+    }
+}
+
+typedef struct
+{
+    uint8_t midi_note;
+    bool is_tied;
+} chord_note_t;
+
+/* Returns the next note, control or end-of-track event without consuming it, entering and leaving macro bodies and
+ * loops on the way; NULL at the end of the song. */
+static const mml_event *
+peek_event (lower_context *ctx)
+{
+    for (;;)
+    {
+        if (ctx->calls.size == 0 && ctx->at.offset >= ctx->song->events.size) return NULL;
+
+        const mml_event *ev = &ctx->at.items[ctx->at.offset];
+        switch (ev->kind)
+        {
+        case MML_EV_EXPAND:
+            ctx->at.offset++;
+            da_append (ctx->arena, &ctx->calls, ctx->at);
+            ctx->at = (event_cursor){ .items = ctx->song->bodies.items, .offset = ev->expand.body };
+            break;
+        case MML_EV_RET: ctx->at = ctx->calls.items[--ctx->calls.size]; break;
+        case MML_EV_LOOP:
+            if (ev->loop.count == 0)
+            {
+                ctx->at.offset += ev->loop.skip + 1;
+                break;
+            }
+            da_reserve (ctx->arena, &ctx->loops, ctx->loops.size + 1);
+            ctx->loops.items[ctx->loops.size].begin = ctx->at.offset + 1;
+            ctx->loops.items[ctx->loops.size].remaining = ev->loop.count;
+            ctx->loops.size++;
+            ctx->at.offset++;
+            break;
+        case MML_EV_BREAK:
+            if (ctx->loops.items[ctx->loops.size - 1].remaining == 1)
+            {
+                ctx->loops.size--;
+                ctx->at.offset += ev->loop.skip + 1;
+            }
+            else
+                ctx->at.offset++;
+            break;
+        case MML_EV_LOOP_END:
+            if (--ctx->loops.items[ctx->loops.size - 1].remaining > 0)
+                ctx->at.offset = ctx->loops.items[ctx->loops.size - 1].begin;
+            else
+            {
+                ctx->loops.size--;
+                ctx->at.offset++;
+            }
+            break;
+        default: return ev;
+        }
+    }
+}
+
+/* Deltas are kept the way the encoder has always computed them, so that the SMF stays byte-identical: a chord whose
+ * first note is still held by a tie starts at the tick of the previous event, and the end of track lands the tick
+ * of the last note after the last event. */
+static uint32_t
+lower_track (lower_context *ctx)
+{
+    uint32_t last_tick = 0;
+
+    memset (ctx->active_notes, 0, sizeof (ctx->active_notes));
+
+    for (;;)
+    {
+        const mml_event *next = peek_event (ctx);
+        if (!next) break;
+
+        mml_event ev = *next;
+
+        if (ev.kind != MML_EV_NOTE)
+        {
+            ctx->at.offset++;
+            MML_STAT_ADD (events_expanded, 1);
+            switch (ev.kind)
+            {
+            case MML_EV_EOT: return last_tick;
+            case MML_EV_CTL: process_control (ctx, ev.ctl.cmd, ev.ctl.value); break;
+            default: break;
+            }
+            continue;
+        }
+
+        chord_note_t batch[128];
+        int batch_count = 0;
+        uint32_t step_duration = 0;
+        bool step_complete = false;
+
+        while (!step_complete)
+        {
+            const mml_event *nev = peek_event (ctx);
+            if (!nev || nev->kind != MML_EV_NOTE) break;
+
+            uint8_t note = midi_note (nev->note.pitch, ctx->octave, nev->note.acc);
+
+            if (note != NOTE_REST)
+            {
+                batch[batch_count].midi_note = note;
+                batch[batch_count].is_tied = nev->note.tie;
+                batch_count++;
+            }
+
+            if (!nev->note.chord_link)
+            {
+                /* macro bodies are shared, so the default length must not be written back into the event */
+                uint32_t length = nev->note.length ? nev->note.length : ctx->default_length;
+                uint32_t dots = nev->note.dots;
+                step_duration = length < DURATION_LENGTHS && dots < DURATION_DOTS
+                                    ? ctx->durations[length][dots]
+                                    : calculate_duration (length, dots, ctx->ticks_per_quarter);
+                step_complete = true;
+            }
+            ctx->at.offset++;
+            MML_STAT_ADD (events_expanded, 1);
+        }
+
+        uint32_t delta = ctx->current_tick - last_tick;
+
+        for (int i = 0; i < batch_count; i++)
+        {
+            uint8_t note = batch[i].midi_note;
+            if (!ctx->active_notes[note])
+            {
+                place (ctx, (i == 0) ? delta : 0, MML_TIMELINE_NOTE_ON, note, ctx->velocity, UINT32_MAX);
+                if (i == 0) delta = 0;
+                ctx->active_notes[note] = ctx->flushed + ctx->out->size;
+            }
+        }
+
+        if (batch_count > 0) { last_tick = ctx->current_tick; }
+
+        ctx->current_tick += step_duration;
+
+        bool first_off = true;
+        uint32_t off_delta = ctx->current_tick - last_tick;
+
+        for (int i = 0; i < batch_count; i++)
+        {
+            uint8_t note = batch[i].midi_note;
+            bool is_tied = batch[i].is_tied;
+
+            if (!is_tied)
+            {
+                place (ctx, first_off ? off_delta : 0, MML_TIMELINE_NOTE_OFF, note, 0, 0);
+                if (first_off)
+                {
+                    off_delta = 0;
+                    last_tick = ctx->current_tick;
+                    first_off = false;
+                }
+
+                /* a note written twice in one chord is released twice, the first release closes its note on; and
+                 * once handed to a sink, the note on is out of reach */
+                if (ctx->active_notes[note] > ctx->flushed)
+                {
+                    mml_timeline_event *on = &ctx->out->items[ctx->active_notes[note] - ctx->flushed - 1];
+                    on->value = ctx->position - on->tick;
+                }
+                ctx->active_notes[note] = 0;
+            }
+        }
+    }
+
+    return last_tick;
+}
+
+static void
+lower (lower_context *ctx, uint32_t ticks_per_quarter)
+{
+    ctx_reset (ctx, ticks_per_quarter);
+
+    place (ctx, 0, MML_TIMELINE_TEMPO, 0, 0, 500000); /* 120 BPM */
+    uint32_t t = lower_track (ctx);
+    place (ctx, t, MML_TIMELINE_END, 0, 0, 0);
+
+    if (!ctx->arena)
+    {
+        free (ctx->calls.items);
+        free (ctx->loops.items);
+    }
+}
+
+void
+mml_lower_track (const mml_song *song, size_t offset, uint32_t ticks_per_quarter, mml_arena *arena,
+                 mml_timeline *out)
+{
+    lower_context ctx = {
+        .out = out,
+        .song = song,
+        .at = { .items = song->events.items, .offset = offset },
+        .arena = arena,
+        .chunk = SIZE_MAX,
+    };
+    lower (&ctx, ticks_per_quarter);
+}
+
+void
+mml_lower_track_chunked (const mml_song *song, size_t offset, uint32_t ticks_per_quarter, mml_arena *arena,
+                         size_t chunk, mml_timeline_sink sink, void *user)
+{
+    mml_timeline out = { 0 };
+    lower_context ctx = {
+        .out = &out,
+        .song = song,
+        .at = { .items = song->events.items, .offset = offset },
+        .arena = arena,
+        .sink = sink,
+        .sink_user = user,
+        .chunk = chunk ? chunk : 1,
+    };
+    da_reserve (arena, &out, ctx.chunk);
+    lower (&ctx, ticks_per_quarter);
+
+    if (out.size > 0) sink (user, out.items, out.size);
+    if (!arena) free (out.items);
+}
+
+/* Track length, computed through the loop and macro structure instead of playing it.
+ * Only `l` changes the length of what follows, and a pass through a loop either leaves the default length alone
+ * or sets it to a fixed value; so every pass after the first starts from the same default length, and two passes
+ * are enough to know the length of any number of them. */
+
+static uint64_t span_ticks (const mml_song *song, const mml_event *items, size_t *offset, uint32_t *default_length,
+                            uint32_t ticks_per_quarter);
+
+static uint64_t
+loop_ticks (const mml_song *song, const mml_event *items, size_t loop, uint32_t *default_length,
+            uint32_t ticks_per_quarter)
+{
+    uint32_t count = items[loop].loop.count;
+    size_t end = loop + items[loop].loop.skip;
+    uint64_t total = 0;
+
+    if (count == 0) return 0;
+
+    for (uint32_t pass = 1;; ++pass)
+    {
+        size_t at = loop + 1;
+        uint64_t body = span_ticks (song, items, &at, default_length, ticks_per_quarter);
+        if (pass == count) return total + body;
+
+        uint64_t brk = 0;
+        if (at != end)
+        {
+            at += 1; /* MML_EV_BREAK */
+            brk = span_ticks (song, items, &at, default_length, ticks_per_quarter);
+        }
+
+        if (pass == 1)
+        {
+            total += body + brk;
+            continue;
+        }
+
+        /* passes 2 .. count - 1 are identical, the last one stops at the break */
+        total += (uint64_t)(count - 2) * (body + brk);
+        at = loop + 1;
+        return total + span_ticks (song, items, &at, default_length, ticks_per_quarter);
+    }
+}
+
+/* Sums the events from `*offset` up to the end of the enclosing track, body, loop pass or break section, and leaves
+ * `*offset` at the event that ended it. */
+static uint64_t
+span_ticks (const mml_song *song, const mml_event *items, size_t *offset, uint32_t *default_length,
+            uint32_t ticks_per_quarter)
+{
+    uint64_t ticks = 0;
+
+    for (;; ++*offset)
+    {
+        if (items == song->events.items && *offset >= song->events.size) return ticks;
+
+        const mml_event *ev = &items[*offset];
+        switch (ev->kind)
+        {
+        case MML_EV_NOTE:
+            if (!ev->note.chord_link)
+            {
+                uint32_t length = ev->note.length ? ev->note.length : *default_length;
+                ticks += calculate_duration (length, ev->note.dots, ticks_per_quarter);
+            }
+            break;
+        case MML_EV_CTL:
+            if (ev->ctl.cmd == 'l') *default_length = ev->ctl.value;
+            break;
+        case MML_EV_EXPAND: {
+            size_t body = ev->expand.body;
+            ticks += span_ticks (song, song->bodies.items, &body, default_length, ticks_per_quarter);
+            break;
+        }
+        case MML_EV_LOOP:
+            ticks += loop_ticks (song, items, *offset, default_length, ticks_per_quarter);
+            *offset += ev->loop.skip;
+            break;
+        case MML_EV_EOT:
+        case MML_EV_RET:
+        case MML_EV_BREAK:
+        case MML_EV_LOOP_END: return ticks;
+        }
+    }
+}
+
+uint64_t
+mml_track_ticks (const mml_song *song, size_t offset, uint32_t ticks_per_quarter)
+{
+    if (!song) return 0;
+
+    uint32_t default_length = 4;
+    return span_ticks (song, song->events.items, &offset, &default_length, ticks_per_quarter);
+}
@@ -3,8 +3,8 @@
 
 #include "mml2midi.h"
 
-#include <assert.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,54 +12,220 @@
 
 typedef struct
 {
-    string_view name;
-    mml_sequence *body;
+    string_view name; /* interned, shared by every definition of the same name */
+    uint64_t hash;
+    uint32_t body; /* offset of the body in `mml_song.bodies` */
 } macro;
 
-typedef struct
+/* Every definition gets its own entry in `items`, in order of appearance. `slots` is an open-addressing
+ * (linear probing) index over the interned names, which maps each name to its latest definition:
+ * a redefinition replaces the macro for every expansion that follows it. All of it, interned names and the bodies
+ * included, lives in `arena`: the song's, or that of the `mml_macros` it is kept in. */
+typedef struct mml_macro_table
 {
     macro *items;
     size_t size, capacity;
+
+    uint32_t *slots; /* 1 + index into `items`; 0 = empty */
+    size_t nslots;   /* power of two, at least twice `size` */
+
+    mml_arena *arena;
 } macross;
 
 typedef struct
 {
-    const token *tokens;
-    size_t idx;
+    mml_lexer *lexer;
+    token lookahead; /* tokens are pulled from the lexer on demand, and the parser looks at most one ahead */
+    bool buffered;   /* whether `lookahead` holds the next token */
+    mml_song *song;
+    mml_arena *arena; /* the song's, or the macro table's in a definition */
     mml_sequence *out_sequence;
-    macross macro_table;
+    macross *macro_table;
+
+    /* constructs being parsed; their closing tokens stop error recovery */
+    unsigned open_loops, open_definitions, open_chords;
 } parser_context;
 
+static void
+report (parser_context *ctx, mml_severity severity, token t, const char *format, va_list args)
+{
+    va_list copy;
+    va_copy (copy, args);
+    int length = vsnprintf (NULL, 0, format, copy);
+    va_end (copy);
+
+    char *message = mml_arena_alloc (&ctx->song->arena, length + 1);
+    vsnprintf (message, length + 1, format, args);
+
+    mml_diagnostics *diagnostics = &ctx->song->diagnostics;
+    mml_diagnostic d = { .severity = severity, .offset = t.offset, .length = t.length, .message = message };
+    da_append (&ctx->song->arena, diagnostics, d);
+    if (severity == MML_SEVERITY_ERROR) diagnostics->errors += 1;
+}
+
+__attribute__ ((format (printf, 3, 4))) static void
+parse_error (parser_context *ctx, token t, const char *format, ...)
+{
+    va_list args;
+    va_start (args, format);
+    report (ctx, MML_SEVERITY_ERROR, t, format, args);
+    va_end (args);
+}
+
+__attribute__ ((format (printf, 3, 4))) static void
+parse_warning (parser_context *ctx, token t, const char *format, ...)
+{
+    va_list args;
+    va_start (args, format);
+    report (ctx, MML_SEVERITY_WARNING, t, format, args);
+    va_end (args);
+}
+
+static uint32_t *
+macro_slot (const macross *table, string_view name, uint64_t hash)
+{
+    size_t mask = table->nslots - 1;
+
+    for (size_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        uint32_t *slot = &table->slots[i];
+        if (*slot == 0) return slot;
+
+        const macro *m = &table->items[*slot - 1];
+        if (m->hash == hash && m->name.size == name.size && memcmp (m->name.data, name.data, name.size) == 0)
+            return slot;
+    }
+}
+
+static void
+macro_rehash (macross *table, size_t nslots)
+{
+    /* the old index is simply abandoned in the arena; all of them add up to less than the final one */
+    table->slots = mml_arena_alloc (table->arena, nslots * sizeof *table->slots);
+    memset (table->slots, 0, nslots * sizeof *table->slots);
+    table->nslots = nslots;
+
+    /* later definitions overwrite earlier ones */
+    for (size_t i = 0; i < table->size; ++i)
+        *macro_slot (table, table->items[i].name, table->items[i].hash) = i + 1;
+}
+
+static string_view
+macro_intern (macross *table, string_view name)
+{
+    char *data = mml_arena_alloc (table->arena, name.size);
+    memcpy (data, name.data, name.size);
+
+    return (string_view){ .data = data, .size = name.size };
+}
+
 macro *
 macro_search (parser_context *ctx, string_view name)
 {
-    for (size_t i = 0; i < ctx->macro_table.size; ++i)
+    const macross *table = ctx->macro_table;
+    if (table->nslots == 0) return NULL;
+
+    uint32_t slot = *macro_slot (table, name, mml_hash64 (name.data, name.size, 0));
+    return slot ? &table->items[slot - 1] : NULL;
+}
+
+void
+macro_define (parser_context *ctx, token def, string_view name, uint32_t body)
+{
+    macross *table = ctx->macro_table;
+
+    if ((table->size + 1) * 2 > table->nslots) macro_rehash (table, table->nslots ? table->nslots * 2 : 64);
+
+    uint64_t hash = mml_hash64 (name.data, name.size, 0);
+    uint32_t *slot = macro_slot (table, name, hash);
+
+    if (*slot)
     {
-        string_view curr = ctx->macro_table.items[i].name;
-        if (curr.size == name.size && memcmp (curr.data, name.data, name.size) == 0) return &ctx->macro_table.items[i];
+        parse_warning (ctx, def, "redefinition of `%.*s`", (int)name.size, name.data);
+        name = table->items[*slot - 1].name;
     }
+    else
+        name = macro_intern (table, name);
 
-    return NULL;
+    macro m = { .name = name, .hash = hash, .body = body };
+    da_append (table->arena, table, m);
+    *slot = table->size;
+}
+
+static const token *
+peek (parser_context *ctx)
+{
+    if (!ctx->buffered)
+    {
+        ctx->lookahead = mml_read_next_token (ctx->lexer);
+        ctx->buffered = true;
+        MML_STAT_ADD (tokens, 1);
+    }
+    return &ctx->lookahead;
 }
 
 token
 advance (parser_context *ctx)
 {
-    return ctx->tokens[ctx->idx++];
+    token t = *peek (ctx);
+    ctx->buffered = false;
+    return t;
 }
 
 bool
 expect (parser_context *ctx, token_kind kind)
 {
-    if (ctx->tokens[ctx->idx].kind != kind) return false;
+    if (peek (ctx)->kind != kind) return false;
     advance (ctx);
     return true;
 }
 
 token_kind
-peek_kind (const parser_context *ctx)
+peek_kind (parser_context *ctx)
 {
-    return ctx->tokens[ctx->idx].kind;
+    return peek (ctx)->kind;
+}
+
+/* `;`, the end of input, or the closing token of a construct that is still open. Definitions do not nest, so a
+ * definition inside one also ends it: the first one most likely lacks its `}`. */
+static bool
+at_sync_point (parser_context *ctx)
+{
+    switch (peek_kind (ctx))
+    {
+    case MML_EOF:
+    case MML_SCOLON: return true;
+    case MML_RBRACKET: return ctx->open_loops > 0;
+    case MML_RBRACE:
+    case MML_DEFINITION: return ctx->open_definitions > 0;
+    case MML_RPAREN: return ctx->open_chords > 0;
+    default: return false;
+    }
+}
+
+/* Panic-mode recovery: drops tokens up to the next sync point, which is left for its construct to consume. */
+static void
+synchronize (parser_context *ctx)
+{
+    while (!at_sync_point (ctx)) advance (ctx);
+}
+
+string_view
+token_text (const parser_context *ctx, token t)
+{
+    return (string_view){ .data = ctx->lexer->data + t.offset, .size = t.length };
+}
+
+unsigned
+token_number (parser_context *ctx, token t)
+{
+    if (t.value == MML_NUMBER_OVERFLOW)
+    {
+        parse_error (ctx, t, "number `%.*s` is too large", (int)t.length, ctx->lexer->data + t.offset);
+        return 0;
+    }
+
+    return t.value;
 }
 
 bool
@@ -68,21 +234,24 @@ parse_expansion (parser_context *ctx)
     if (peek_kind (ctx) != MML_EXPANSION) return false;
 
     token def = advance (ctx);
-    string_view ident = (string_view){ .data = def.view.data + 1, .size = def.view.size - 1 };
+    string_view ident = token_text (ctx, def);
+    ident.data += 1;
+    ident.size -= 1;
     if (ident.size == 0)
     {
-        fprintf (stderr, "mml: expected identifier after '@'\n");
-        abort ();
+        parse_error (ctx, def, "expected a macro name after `@`");
+        return true;
     }
 
     macro *m = macro_search (ctx, ident);
     if (!m)
     {
-        fprintf (stderr, "mml: macro `%.*s` is not defined\n", (int)ident.size, ident.data);
-        abort ();
+        parse_error (ctx, def, "macro `%.*s` is not defined", (int)ident.size, ident.data);
+        return true;
     }
 
-    da_append_many (ctx->out_sequence, m->body->items, m->body->size);
+    mml_event ev = { .expand = { .kind = MML_EV_EXPAND, .body = m->body } };
+    da_append (ctx->arena, ctx->out_sequence, ev);
 
     return true;
 }
@@ -93,7 +262,7 @@ parse_note (parser_context *ctx)
     if (peek_kind (ctx) != MML_NOTE) return false;
 
     token note = advance (ctx);
-    char pitch = note.view.data[0]; // THIS LIMITS PITCH TO ASCII!!!
+    char pitch = token_text (ctx, note).data[0]; // THIS LIMITS PITCH TO ASCII!!!
 
     /* accidental */
     int acc = 0;
@@ -114,13 +283,7 @@ parse_note (parser_context *ctx)
 
     if (peek_kind (ctx) == MML_NUMBER)
     {
-        token lentok = advance (ctx);
-        char buffer[32];
-        memcpy (buffer, lentok.view.data, lentok.view.size);
-        buffer[lentok.view.size] = 0;
-        char *endptr = NULL;
-        length = strtoul (buffer, &endptr, 10);
-        assert (*endptr == 0); // tokenizer failed, if false.
+        length = token_number (ctx, advance (ctx));
     }
 
     /* dots */
@@ -129,7 +292,7 @@ parse_note (parser_context *ctx)
     for (;;)
     {
         if (peek_kind (ctx) != MML_DOT) break;
-        dots++;
+        if (dots < MML_DOTS_MAX) dots++;
         advance (ctx);
     }
 
@@ -142,9 +305,9 @@ parse_note (parser_context *ctx)
 
     mml_event ev =
     {
-        .kind = MML_EV_NOTE,
-        .as.note = 
+        .note = 
         {
+            .kind = MML_EV_NOTE,
             .pitch = pitch,
             .acc = acc,
             .length = length,
@@ -154,7 +317,7 @@ parse_note (parser_context *ctx)
         },
     };
 
-    da_append (ctx->out_sequence, ev);
+    da_append (ctx->arena, ctx->out_sequence, ev);
 
     return true;
 }
@@ -166,115 +329,86 @@ parse_command (parser_context *ctx)
 
     token cmdtok = advance (ctx);
 
-    char cmd = cmdtok.view.data[0]; // this limits commands to ASCII !!!
+    char cmd = token_text (ctx, cmdtok).data[0]; // this limits commands to ASCII !!!
 
     /* numerical argument */
     unsigned arg = 0;
     if (peek_kind (ctx) == MML_NUMBER)
     {
-        token argtok = advance (ctx);
-
-        char buffer[32];
-        memcpy (buffer, argtok.view.data, argtok.view.size);
-        buffer[argtok.view.size] = 0;
-
-        char *endptr = NULL;
-        arg = strtoul (buffer, &endptr, 10);
-        assert (*endptr == 0); // tokenizer failed, if false.
+        arg = token_number (ctx, advance (ctx));
     }
 
     mml_event ev = {
-        .kind = MML_EV_CTL,
-        .as.ctl = {
+        .ctl = {
+            .kind = MML_EV_CTL,
             .cmd = cmd,
             .value = arg,
         },
     };
 
-    da_append (ctx->out_sequence, ev);
+    da_append (ctx->arena, ctx->out_sequence, ev);
 
     return true;
 }
 
 bool parse_action (parser_context *ctx);
+void parse_body (parser_context *ctx, const char *where, token_kind stop);
 
+/* Loops are not unrolled: the body is emitted once, between MML_EV_LOOP and MML_EV_LOOP_END, with an MML_EV_BREAK
+ * in place of ':'. The repeat count and the jump distances are patched in once the closing bracket is read. */
 bool
 parse_loop (parser_context *ctx)
 {
     if (peek_kind (ctx) != MML_LBRACKET) return false;
-    advance (ctx);
-
-    mml_sequence *parent_seq = ctx->out_sequence;
+    token open = advance (ctx);
 
-    mml_sequence *loop_seq = calloc (1, sizeof (mml_sequence));
-    ctx->out_sequence = loop_seq;
+    mml_sequence *seq = ctx->out_sequence;
 
-    for (;;)
-    {
-        token_kind kind = peek_kind (ctx);
-        if (kind == MML_EOF || kind == MML_RBRACKET || kind == MML_COLON) break;
+    size_t begin = seq->size;
+    mml_event loop = { .loop = { .kind = MML_EV_LOOP } };
+    da_append (ctx->arena, seq, loop);
 
-        if (!parse_action (ctx))
-        {
-            token t = advance (ctx);
-            fprintf (stderr, "mml: Unexpected token in loop body: `%.*s` (%d)\n", (int)t.view.size, t.view.data,
-                     t.kind);
-            abort ();
-        }
-    }
+    ctx->open_loops += 1;
+    parse_body (ctx, "loop body", MML_COLON);
 
-    mml_sequence *break_seq = calloc (1, sizeof (mml_sequence));
+    size_t brk = 0; /* the loop event itself is at `begin`, so 0 means no break section */
 
     if (peek_kind (ctx) == MML_COLON)
     {
         advance (ctx);
-        ctx->out_sequence = break_seq;
 
-        for (;;)
-        {
-            token_kind kind = peek_kind (ctx);
-            if (kind == MML_EOF || kind == MML_RBRACKET) break;
+        brk = seq->size;
+        mml_event ev = { .loop = { .kind = MML_EV_BREAK } };
+        da_append (ctx->arena, seq, ev);
 
-            if (!parse_action (ctx))
-            {
-                token t = advance (ctx);
-                fprintf (stderr, "mml: Unexpected token in loop break body: `%.*s` (%d)\n", (int)t.view.size,
-                         t.view.data, t.kind);
-                abort ();
-            }
-        }
+        parse_body (ctx, "loop body", MML_EOF);
     }
+    ctx->open_loops -= 1;
 
-    ctx->out_sequence = parent_seq;
-
+    /* an unterminated loop still gets its end event, so the sequence stays well-formed */
+    unsigned loopi = 1;
     if (!expect (ctx, MML_RBRACKET))
+        parse_error (ctx, open, "loop is not closed with `]`");
+    else if (peek_kind (ctx) != MML_NUMBER)
+        parse_error (ctx, *peek (ctx), "expected a repeat count after `]`");
+    else
     {
-        fprintf (stderr, "mml: expected closing bracket ']'\n");
-        abort ();
-    }
-
-    if (peek_kind (ctx) != MML_NUMBER)
-    {
-        fprintf (stderr, "mml: expected number after loop body\n");
-        abort ();
+        token count = advance (ctx);
+        loopi = token_number (ctx, count);
+        if (loopi > MML_LOOP_COUNT_MAX)
+        {
+            parse_error (ctx, count, "repeat count %u is too large, the limit is %u", loopi, MML_LOOP_COUNT_MAX);
+            loopi = 1;
+        }
     }
 
-    token itok = advance (ctx);
-
-    char buffer[32];
-    memcpy (buffer, itok.view.data, itok.view.size);
-    buffer[itok.view.size] = 0;
+    size_t end = seq->size;
+    mml_event ev = { .loop = { .kind = MML_EV_LOOP_END } };
+    da_append (ctx->arena, seq, ev);
 
-    char *endptr = NULL;
-    unsigned loopi = strtoul (buffer, &endptr, 10);
-    assert (*endptr == 0); // tokenizer failed, if false.
-
-    for (unsigned i = 0; i < loopi - 1; ++i)
-    {
-        da_append_many (parent_seq, loop_seq->items, loop_seq->size);
-        if (break_seq->size > 0) da_append_many (parent_seq, break_seq->items, break_seq->size);
-    }
-    da_append_many (parent_seq, loop_seq->items, loop_seq->size);
+    seq->items[begin].loop.count = loopi;
+    seq->items[begin].loop.skip = end - begin;
+    if (brk) seq->items[brk].loop.skip = end - brk;
 
     return true;
 }
@@ -283,24 +417,23 @@ bool
 parse_chord (parser_context *ctx)
 {
     if (peek_kind (ctx) != MML_LPAREN) return false;
-    advance (ctx);
-
-    mml_sequence *parent_seq = ctx->out_sequence;
+    token open = advance (ctx);
 
-    mml_sequence *chordseq = calloc (1, sizeof (mml_sequence));
-    ctx->out_sequence = chordseq;
+    /* the notes go straight into the output; length, dots and tie follow the ')' and are patched in afterwards */
+    mml_sequence *seq = ctx->out_sequence;
+    size_t begin = seq->size;
 
-    for (;;)
+    ctx->open_chords += 1;
+    while (!at_sync_point (ctx))
     {
-        token_kind kind = peek_kind (ctx);
-        if (kind == MML_RPAREN || kind == MML_EOF) break;
-
         token t = advance (ctx);
 
         if (t.kind != MML_NOTE)
         {
-            fprintf (stderr, "mml: invalid token kind in chord: `%.*s`\n", (int)t.view.size, t.view.data);
-            abort ();
+            parse_error (ctx, t, "only notes may appear in a chord, found `%.*s`", (int)t.length,
+                         ctx->lexer->data + t.offset);
+            synchronize (ctx);
+            break;
         }
 
         int acc = 0;
@@ -317,9 +450,9 @@ parse_chord (parser_context *ctx)
 
         mml_event ev = 
         {
-            .kind = MML_EV_NOTE,
-            .as.note = {
-                .pitch = t.view.data[0],
+            .note = {
+                .kind = MML_EV_NOTE,
+                .pitch = token_text (ctx, t).data[0],
                 .acc = acc,
                 .dots = 0,
                 .length = 0,
@@ -328,54 +461,43 @@ parse_chord (parser_context *ctx)
             },
         };
 
-        da_append (ctx->out_sequence, ev);
+        da_append (ctx->arena, seq, ev);
     }
 
-    ctx->out_sequence = parent_seq;
+    ctx->open_chords -= 1;
 
-    if (!expect (ctx, MML_RPAREN))
-    {
-        fprintf (stderr, "mml: Expected ')' at the end of a chord\n");
-        abort ();
-    }
+    /* the length of an unterminated chord is left unparsed; whatever follows belongs to an enclosing construct */
+    bool closed = expect (ctx, MML_RPAREN);
+    if (!closed) parse_error (ctx, open, "chord is not closed with `)`");
 
     unsigned length = 0;
-    if (peek_kind (ctx) == MML_NUMBER)
+    if (closed && peek_kind (ctx) == MML_NUMBER)
     {
-        token numtok = advance (ctx);
-
-        char buffer[32];
-        memcpy (buffer, numtok.view.data, numtok.view.size);
-        buffer[numtok.view.size] = 0;
-
-        char *endptr = NULL;
-        length = strtoul (buffer, &endptr, 10);
-        assert (*endptr == 0); // tokenizer failed, if false.
+        length = token_number (ctx, advance (ctx));
     }
 
     unsigned dots = 0;
     for (;;)
     {
-        if (peek_kind (ctx) != MML_DOT) break;
-        dots++;
+        if (!closed || peek_kind (ctx) != MML_DOT) break;
+        if (dots < MML_DOTS_MAX) dots++;
         advance (ctx);
     }
 
     bool tie = false;
-    if (peek_kind (ctx) == MML_AMP)
+    if (closed && peek_kind (ctx) == MML_AMP)
     {
         advance (ctx);
         tie = true;
     }
 
-    for (size_t i = 0; i < chordseq->size; ++i)
+    for (size_t i = begin; i < seq->size; ++i)
     {
-        mml_event ev = chordseq->items[i];
-        ev.as.note.length = length;
-        ev.as.note.dots = dots;
-        ev.as.note.tie = tie;
-        ev.as.note.chord_link = i != chordseq->size - 1;
-        da_append (parent_seq, ev);
+        mml_event *ev = &seq->items[i];
+        ev->note.length = length;
+        ev->note.dots = dots;
+        ev->note.tie = tie;
+        ev->note.chord_link = i != seq->size - 1;
     }
 
     return true;
@@ -399,109 +521,204 @@ parse_definition (parser_context *ctx)
     if (peek_kind (ctx) != MML_DEFINITION) return false;
 
     token def = advance (ctx);
-    string_view ident = (string_view){ .data = def.view.data + 1, .size = def.view.size - 1 };
-    if (ident.size == 0)
-    {
-        fprintf (stderr, "mml: expected identifier after '@'\n");
-        abort ();
-    }
+    string_view ident = token_text (ctx, def);
+    ident.data += 1;
+    ident.size -= 1;
+    if (ident.size == 0) parse_error (ctx, def, "expected a macro name after `!`");
 
     if (!expect (ctx, MML_LBRACE))
     {
-        fprintf (stderr, "mml: expected '{' after DEFINITION\n");
-        abort ();
+        parse_error (ctx, def, "expected `{` after `%.*s`", (int)def.length, ctx->lexer->data + def.offset);
+        synchronize (ctx);
+        return true;
     }
 
+    /* definitions do not nest, so the body is parsed straight into the shared body storage */
     mml_sequence *parent_seq = ctx->out_sequence;
+    mml_arena *parent_arena = ctx->arena;
+    mml_sequence *bodies = &ctx->song->bodies;
+    size_t body = bodies->size;
+    ctx->out_sequence = bodies;
+    ctx->arena = ctx->macro_table->arena;
 
-    mml_sequence *macro_seq = calloc (1, sizeof (mml_sequence));
-    ctx->out_sequence = macro_seq;
-
-    for (;;)
-    {
-        token_kind kind = peek_kind (ctx);
-        if (kind == MML_EOF || kind == MML_RBRACE) break;
-
-        if (!parse_action (ctx))
-        {
-            fprintf (stderr, "mml: Unexpected token in definition body\n");
-            abort ();
-        }
-    }
+    ctx->open_definitions += 1;
+    parse_body (ctx, "macro definition", MML_EOF);
+    ctx->open_definitions -= 1;
 
     ctx->out_sequence = parent_seq;
+    ctx->arena = parent_arena;
 
     if (!expect (ctx, MML_RBRACE))
-    {
-        fprintf (stderr, "mml: expected closing brace '}'\n");
-        abort ();
-    }
-
-    if (macro_seq->size == 0)
+        parse_error (ctx, def, "definition of `%.*s` is not closed with `}`", (int)ident.size, ident.data);
 
+    if (bodies->size == body)
     {
-        printf ("mml: warning: empty definition `%.*s`\n", (int)ident.size, ident.data);
+        parse_warning (ctx, def, "empty definition `%.*s`", (int)ident.size, ident.data);
         return true;
     }
 
-    // printf ("mml: parsed definition `%.*s`, with length of %zu\n", (int)ident.size, ident.data, macro_seq->size);
+    mml_event ret = { .kind = MML_EV_RET };
+    da_append (ctx->macro_table->arena, bodies, ret);
 
-    macro m = { .name = ident, .body = macro_seq };
-    da_append (&ctx->macro_table, m);
+    if (ident.size) macro_define (ctx, def, ident, body);
 
     return true;
 }
 
+/* Parses actions up to `stop` or a sync point. A closing token that matches no open construct is reported and
+ * skipped; any other token that does not start an action is reported and skipped up to the next sync point. */
 void
-parse_track (parser_context *ctx)
+parse_body (parser_context *ctx, const char *where, token_kind stop)
 {
     for (;;)
     {
-        token_kind kind = peek_kind (ctx);
-        switch (kind)
+        if (peek_kind (ctx) == stop || at_sync_point (ctx)) return;
+
+        switch (peek_kind (ctx))
         {
-        case MML_EOF:
-        case MML_SCOLON: return;
-        case MML_DEFINITION: parse_definition (ctx); break;
+        case MML_RBRACKET:
+        case MML_RBRACE:
+        case MML_RPAREN: {
+            token t = advance (ctx);
+            parse_error (ctx, t, "unmatched `%.*s` in %s", (int)t.length, ctx->lexer->data + t.offset, where);
+            break;
+        }
+        case MML_DEFINITION:
+            if (ctx->open_loops) parse_error (ctx, *peek (ctx), "macros cannot be defined inside a loop");
+            parse_definition (ctx);
+            break;
         default:
             if (!parse_action (ctx))
             {
                 token t = advance (ctx);
-                fprintf (stderr, "mml: Unexpected token in track body: `%.*s` (%d)\n", (int)t.view.size, t.view.data,
-                         t.kind);
-                abort ();
+                parse_error (ctx, t, "unexpected `%.*s` in %s", (int)t.length, ctx->lexer->data + t.offset, where);
+                synchronize (ctx);
             }
             break;
         }
     }
 }
 
-int
-mml_parse (const token *tokens, mml_sequence *out_sequence)
+static int
+parse (mml_lexer *lexer, mml_song *out_song, macross *macro_table)
 {
-    if (!tokens || (*tokens).kind == MML_EOF)
+    if (!lexer || !out_song)
     {
         errno = EINVAL;
         return -1;
     }
 
-    parser_context ctx = { tokens, 0, out_sequence, .macro_table = { 0 } };
+    mml_sequence *out_sequence = &out_song->events;
+    parser_context ctx = {
+        .lexer = lexer,
+        .song = out_song,
+        .arena = &out_song->arena,
+        .out_sequence = out_sequence,
+        .macro_table = macro_table,
+    };
+
+    if (peek_kind (&ctx) == MML_EOF)
+    {
+        errno = EINVAL;
+        return -1;
+    }
 
     for (;;)
     {
         token_kind kind = peek_kind (&ctx);
         switch (kind)
         {
-        case MML_EOF: return 0;
+        case MML_EOF: return out_song->diagnostics.errors;
         case MML_SCOLON: {
             mml_event ev = { .kind = MML_EV_EOT };
-            da_append (out_sequence, ev);
+            da_append (ctx.arena, out_sequence, ev);
             advance (&ctx);
             break;
         }
-        default: parse_track (&ctx); break;
+        default: parse_body (&ctx, "track", MML_EOF); break;
         }
     }
+}
+
+int
+mml_parse (mml_lexer *lexer, mml_song *out_song)
+{
+    macross macro_table = { .arena = out_song ? &out_song->arena : NULL };
+    return parse (lexer, out_song, &macro_table);
+}
+
+/* Nothing the parser holds outlives a `;` but the macros, so a piece parses as it does within the whole source */
+int
+mml_parse_piece (mml_lexer *lexer, mml_song *out_song, mml_macros *macros)
+{
+    if (!out_song || !macros)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!macros->table)
+    {
+        macros->table = mml_arena_alloc (&macros->arena, sizeof *macros->table);
+        *macros->table = (macross){ 0 };
+    }
+    macros->table->arena = &macros->arena;
+
+    out_song->bodies = macros->bodies;
+    int result = parse (lexer, out_song, macros->table);
+    macros->bodies = out_song->bodies;
+    return result;
+}
+
+void
+mml_macros_free (mml_macros *macros)
+{
+    macros->bodies = (mml_sequence){ 0 };
+    macros->table = NULL;
+    mml_arena_free (&macros->arena);
+}
+
+void
+mml_source_position (const char *data, size_t size, size_t offset, unsigned *line, unsigned *column)
+{
+    if (offset > size) offset = size;
+
+    unsigned lines = 1;
+    size_t line_start = 0;
+    for (const char *nl; (nl = memchr (data + line_start, '\n', offset - line_start)); lines++)
+        line_start = nl - data + 1;
+
+    *line = lines;
+    *column = offset - line_start + 1;
+}
+
+void
+mml_diagnostics_print (FILE *out, const char *path, const char *data, size_t size, const mml_diagnostics *diagnostics)
+{
+    for (size_t i = 0; i < diagnostics->size; ++i)
+    {
+        const mml_diagnostic *d = &diagnostics->items[i];
+        unsigned line, column;
+        mml_source_position (data, size, d->offset, &line, &column);
+        fprintf (out, "%s:%u:%u: %s: %s\n", path, line, column,
+                 d->severity == MML_SEVERITY_ERROR ? "error" : "warning", d->message);
+    }
+}
+
+void
+mml_song_reset (mml_song *song)
+{
+    song->events = (mml_sequence){ 0 };
+    song->bodies = (mml_sequence){ 0 };
+    song->diagnostics = (mml_diagnostics){ 0 };
+    mml_arena_reset (&song->arena);
+}
 
-    return 0;
+void
+mml_song_free (mml_song *song)
+{
+    song->events = (mml_sequence){ 0 };
+    song->bodies = (mml_sequence){ 0 };
+    song->diagnostics = (mml_diagnostics){ 0 };
+    mml_arena_free (&song->arena);
 }
@@ -0,0 +1,328 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright (C) 2026 virtualgrub39
+
+/* Playback mode: plays the song as raw MIDI bytes, each message written at its wall-clock instant, for auditioning
+ * without going through an SMF.
+ *
+ * usage: mml2midi --play <fifo|unix-socket> input.mml
+ *
+ * Every track is lowered to its timeline, and the timelines are merged by tick. Ticks become nanoseconds through the
+ * tempo in effect, which `t` changes for all the tracks, the way players treat the tempo of a format 1 SMF. All the
+ * messages due at one instant go out in one write, once an absolute timerfd expires. When the song ends or is
+ * interrupted, the distribution of the delay between due and actual write times is printed. */
+
+#define _DEFAULT_SOURCE
+
+#include "mml2midi.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STATUS_NOTE_ON 0x90 /* note offs are sent as note on with velocity 0, as in the SMF */
+#define STATUS_CONTROLLER 0xB0
+#define CONTROLLER_ALL_NOTES_OFF 123
+
+#define DEFAULT_TEMPO_US 500000 /* 120 BPM, until the first `t`, as lowered at the start of every track */
+
+typedef struct
+{
+    mml_timeline timeline;
+    size_t next;
+} play_track;
+
+/* Converts ticks to nanoseconds since the start of the song */
+typedef struct
+{
+    uint64_t base_ns;   /* time of `base_tick` */
+    uint32_t base_tick; /* of the latest tempo change */
+    uint32_t tempo_us;  /* per quarter note */
+} play_clock;
+
+typedef struct
+{
+    uint64_t *items;
+    size_t size, capacity;
+} play_delays;
+
+typedef struct
+{
+    int out, timer;
+    uint64_t start_ns; /* CLOCK_MONOTONIC */
+
+    uint8_t buffer[4096]; /* messages due at `due_ns` */
+    size_t size;
+    uint64_t due_ns;
+
+    play_delays delays; /* of every write, in nanoseconds */
+} player;
+
+static volatile sig_atomic_t stop;
+
+static void
+on_signal (int signal)
+{
+    (void)signal;
+    stop = 1;
+}
+
+static uint64_t
+now_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+tick_ns (const play_clock *clock, uint32_t tick)
+{
+    /* at most 2^32 ticks times 2^24 us per quarter, so the product fits before the division */
+    uint64_t us_ppq = (uint64_t)(tick - clock->base_tick) * clock->tempo_us;
+    return clock->base_ns + us_ppq / MML_SMF_PPQ * 1000 + us_ppq % MML_SMF_PPQ * 1000 / MML_SMF_PPQ;
+}
+
+/* FIFOs, character devices and files are opened; sockets are connected to, as a stream or else as datagrams */
+static int
+open_output (const char *path)
+{
+    struct stat st;
+    if (stat (path, &st) != 0) return -1;
+    if (!S_ISSOCK (st.st_mode)) return open (path, O_WRONLY | O_CLOEXEC);
+
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen (path) >= sizeof address.sun_path)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy (address.sun_path, path);
+
+    static const int types[] = { SOCK_STREAM, SOCK_SEQPACKET, SOCK_DGRAM };
+    for (size_t i = 0; i < sizeof types / sizeof *types; ++i)
+    {
+        int fd = socket (AF_UNIX, types[i] | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        if (connect (fd, (const struct sockaddr *)&address, sizeof address) == 0) return fd;
+
+        int error = errno;
+        close (fd);
+        errno = error;
+        if (error != EPROTOTYPE) return -1;
+    }
+
+    return -1;
+}
+
+static int
+write_all (int fd, const uint8_t *data, size_t size)
+{
+    for (size_t done = 0; done < size;)
+    {
+        ssize_t n = write (fd, data + done, size - done);
+        if (n < 0 && errno == EINTR && !stop) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+/* Waits for the instant the pending messages are due, then writes them */
+static int
+flush (player *p)
+{
+    if (p->size == 0) return 0;
+
+    uint64_t due = p->start_ns + p->due_ns;
+    struct itimerspec when = { .it_value = { .tv_sec = due / 1000000000, .tv_nsec = due % 1000000000 } };
+    if (timerfd_settime (p->timer, TFD_TIMER_ABSTIME, &when, NULL) != 0) return -1;
+
+    uint64_t expirations;
+    while (read (p->timer, &expirations, sizeof expirations) < 0)
+        if (errno != EINTR || stop) return -1;
+
+    uint64_t late = now_ns () - due;
+    if (write_all (p->out, p->buffer, p->size) != 0) return -1;
+
+    da_append (NULL, &p->delays, late);
+    p->size = 0;
+    return 0;
+}
+
+static int
+queue (player *p, uint64_t due_ns, uint8_t status, uint8_t data1, uint8_t data2)
+{
+    if ((p->size && due_ns != p->due_ns) || p->size + 3 > sizeof p->buffer)
+        if (flush (p) != 0) return -1;
+
+    p->due_ns = due_ns;
+    p->buffer[p->size++] = status;
+    p->buffer[p->size++] = data1;
+    p->buffer[p->size++] = data2;
+    return 0;
+}
+
+/* The track whose next event comes first; the lower track on a tie, as each track's events keep their order */
+static int
+next_track (const play_track *tracks, size_t ntracks)
+{
+    int best = -1;
+    for (size_t i = 0; i < ntracks; ++i)
+    {
+        const play_track *t = &tracks[i];
+        if (t->next == t->timeline.size) continue;
+        if (best < 0 || t->timeline.items[t->next].tick < tracks[best].timeline.items[tracks[best].next].tick)
+            best = i;
+    }
+    return best;
+}
+
+static int
+play (player *p, play_track *tracks, size_t ntracks)
+{
+    play_clock clock = { .tempo_us = DEFAULT_TEMPO_US };
+    p->start_ns = now_ns ();
+
+    for (int t; (t = next_track (tracks, ntracks)) >= 0;)
+    {
+        const mml_timeline_event *ev = &tracks[t].timeline.items[tracks[t].next++];
+        uint64_t due = tick_ns (&clock, ev->tick);
+        int result = 0;
+
+        switch (ev->kind)
+        {
+        case MML_TIMELINE_NOTE_ON: result = queue (p, due, STATUS_NOTE_ON | t, ev->note, ev->velocity); break;
+        case MML_TIMELINE_NOTE_OFF: result = queue (p, due, STATUS_NOTE_ON | t, ev->note, 0); break;
+        case MML_TIMELINE_TEMPO: clock = (play_clock){ .base_ns = due, .base_tick = ev->tick, .tempo_us = ev->value };
+            break;
+        case MML_TIMELINE_END: break;
+        }
+        if (result != 0) return -1;
+    }
+
+    return flush (p);
+}
+
+static int
+compare_u64 (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void
+print_delays (play_delays *delays)
+{
+    if (!delays->size) return;
+
+    qsort (delays->items, delays->size, sizeof *delays->items, compare_u64);
+
+    static const double percentiles[] = { 50, 90, 99, 99.9 };
+    fprintf (stderr, "mml: %zu writes, delay after the due time:", delays->size);
+    for (size_t i = 0; i < sizeof percentiles / sizeof *percentiles; ++i)
+    {
+        size_t rank = (size_t)(percentiles[i] / 100 * (delays->size - 1) + 0.5);
+        fprintf (stderr, " p%g %.1f us,", percentiles[i], delays->items[rank] / 1e3);
+    }
+    fprintf (stderr, " max %.1f us\n", delays->items[delays->size - 1] / 1e3);
+}
+
+static void
+usage (void)
+{
+    fprintf (stderr, "usage: mml2midi --play <fifo|unix-socket> input.mml\n");
+}
+
+int
+mml_play_main (int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        usage ();
+        return 1;
+    }
+    const char *out_path = argv[1], *in_path = argv[2];
+
+    mml_source source;
+    if (mml_source_open (&source, in_path, 0) != 0) return 2;
+
+    mml_lexer lexer;
+    if (mml_lexer_init (&lexer, source.data, source.size) != 0) return 3;
+
+    mml_song song = { 0 };
+    int errors = mml_parse (&lexer, &song);
+    mml_diagnostics_print (stderr, in_path, source.data, source.size, &song.diagnostics);
+    if (errors > 0)
+    {
+        fprintf (stderr, "%s: %d error%s\n", in_path, errors, errors == 1 ? "" : "s");
+        mml_song_free (&song);
+        mml_source_close (&source);
+        return 4;
+    }
+
+    /* the tracks the writer would write: one per `;`, and as many as there are channels */
+    play_track tracks[MML_SMF_MAX_TRACKS] = { 0 };
+    size_t ntracks = 0;
+    for (size_t offset = 0; offset < song.events.size && ntracks < MML_SMF_MAX_TRACKS;)
+    {
+        /* every timeline opens with the default tempo, which the clock starts at; replayed for a later track, it would
+         * undo the `t` of the tracks before it */
+        mml_lower_track (&song, offset, MML_SMF_PPQ, &song.arena, &tracks[ntracks].timeline);
+        tracks[ntracks++].next = 1;
+        while (offset < song.events.size && song.events.items[offset].kind != MML_EV_EOT) offset++;
+        offset++;
+    }
+
+    /* no SA_RESTART: an interrupted wait returns, so that the sounding notes can be silenced */
+    struct sigaction action = { .sa_handler = on_signal };
+    sigaction (SIGINT, &action, NULL);
+    sigaction (SIGTERM, &action, NULL);
+    signal (SIGPIPE, SIG_IGN);
+
+    fprintf (stderr, "mml: waiting for %s\n", out_path);
+    player p = { .out = open_output (out_path), .timer = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC) };
+    if (p.out < 0 || p.timer < 0)
+    {
+        perror ("mml: Failed to open output");
+        mml_song_free (&song);
+        mml_source_close (&source);
+        return 5;
+    }
+
+    /* timers may fire up to the thread's slack late, 50 us by default; a real-time priority keeps other threads from
+     * delaying the writes, when the process is allowed one */
+    prctl (PR_SET_TIMERSLACK, 1UL);
+    struct sched_param param = { .sched_priority = 1 };
+    sched_setscheduler (0, SCHED_FIFO, &param);
+
+    int result = play (&p, tracks, ntracks);
+    if (result != 0 && !stop) perror ("mml: Failed to play");
+
+    /* whatever was interrupted, nothing keeps sounding */
+    p.size = 0;
+    for (size_t i = 0; i < ntracks; ++i)
+    {
+        p.buffer[p.size++] = STATUS_CONTROLLER | i;
+        p.buffer[p.size++] = CONTROLLER_ALL_NOTES_OFF;
+        p.buffer[p.size++] = 0;
+    }
+    if (stop) write_all (p.out, p.buffer, p.size);
+
+    print_delays (&p.delays);
+
+    free (p.delays.items);
+    close (p.timer);
+    close (p.out);
+    mml_song_free (&song);
+    mml_source_close (&source);
+    return result != 0 && !stop ? 5 : 0;
+}
@@ -1,10 +1,21 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 // Copyright (C) 2026 virtualgrub39
 
+#define _DEFAULT_SOURCE
+
 #include "mml2midi.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MML_READ_CHUNK (64 * 1024)
 
 char *
 mml_read_all (const char *path)
@@ -22,16 +33,158 @@ mml_read_all (const char *path)
     long len = ftell (mmlf);
     fseek (mmlf, 0, SEEK_SET);
 
+    if (len < 0)
+    {
+        perror ("mml: Failed to read from file");
+        fclose (mmlf);
+        return NULL;
+    }
+
     char *bytes = malloc (len * sizeof *bytes + 1);
 
-    if (fread (bytes, sizeof *bytes, len, mmlf) != len)
+    if (fread (bytes, sizeof *bytes, len, mmlf) != (size_t)len)
     {
         perror ("mml: Failed to read from file");
+        fclose (mmlf);
         free (bytes);
         return NULL;
     }
 
+    fclose (mmlf);
     bytes[len] = 0;
 
     return bytes;
 }
+
+/* Reads `fd` until EOF into a heap buffer that doubles in size, starting at MML_READ_CHUNK.
+ * Used for stdin, pipes, FIFOs and anything else that cannot be mapped. */
+static int
+source_read_stream (mml_source *src, int fd, unsigned flags)
+{
+    size_t size = 0, capacity = 0;
+    char *bytes = NULL;
+
+    for (;;)
+    {
+        if (size == capacity)
+        {
+            size_t new_capacity = capacity ? capacity * 2 : MML_READ_CHUNK;
+            if (new_capacity < capacity)
+            {
+                errno = EFBIG;
+                goto fail;
+            }
+
+            char *new_bytes = realloc (bytes, new_capacity);
+            MML_STAT_ADD (reallocs, 1);
+            if (!new_bytes) goto fail;
+            bytes = new_bytes;
+            capacity = new_capacity;
+
+#ifdef MADV_HUGEPAGE
+            if ((flags & MML_SOURCE_HUGEPAGES) && capacity >= (2u << 20))
+                madvise ((void *)((uintptr_t)bytes & ~(uintptr_t)(sysconf (_SC_PAGESIZE) - 1)), capacity,
+                         MADV_HUGEPAGE);
+#endif
+        }
+
+        ssize_t n = read (fd, bytes + size, capacity - size);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            goto fail;
+        }
+        if (n == 0) break;
+        size += (size_t)n;
+    }
+
+    src->data = size ? bytes : "";
+    src->size = size;
+    src->base = bytes;
+    src->mapped = false;
+    return 0;
+
+fail:
+    free (bytes);
+    return -1;
+}
+
+static int
+source_map (mml_source *src, int fd, size_t size, unsigned flags)
+{
+    void *base = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) return -1;
+
+    madvise (base, size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    if (flags & MML_SOURCE_HUGEPAGES) madvise (base, size, MADV_HUGEPAGE);
+#endif
+
+    src->data = base;
+    src->size = size;
+    src->base = base;
+    src->mapped = true;
+    return 0;
+}
+
+int
+mml_source_open (mml_source *src, const char *path, unsigned flags)
+{
+    if (!src)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *src = (mml_source){ .data = "" };
+
+    bool use_stdin = path == NULL || strcmp (path, "-") == 0;
+    int fd = use_stdin ? STDIN_FILENO : open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        perror ("mml: Failed to open file for reading");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat (fd, &st) != 0)
+    {
+        perror ("mml: Failed to stat input");
+        if (!use_stdin) close (fd);
+        return -1;
+    }
+
+    int result;
+    if (S_ISREG (st.st_mode) && !(flags & MML_SOURCE_NOMAP))
+    {
+        if ((uint64_t)st.st_size > SIZE_MAX)
+        {
+            errno = EFBIG;
+            result = -1;
+        }
+        else if (st.st_size == 0)
+            result = 0;
+        else
+            result = source_map (src, fd, (size_t)st.st_size, flags);
+    }
+    else
+        result = source_read_stream (src, fd, flags);
+
+    if (result != 0) perror ("mml: Failed to read from file");
+    if (!use_stdin) close (fd);
+
+    return result;
+}
+
+void
+mml_source_close (mml_source *src)
+{
+    if (!src) return;
+
+    if (src->mapped)
+        munmap (src->base, src->size);
+    else
+        free (src->base);
+
+    *src = (mml_source){ .data = "" };
+}
@@ -0,0 +1,279 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright (C) 2026 virtualgrub39
+
+/* Run scanners for the lexer: each kernel returns the offset of the first byte at or after `offset` that ends the
+ * run (or `size`). The vector kernels classify 16 (SSE2) or 32 (AVX2) bytes per step and fall back to the scalar
+ * loop for the tail, so they never read past `size`. */
+
+#include "mml2midi.h"
+
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#define MML_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+/* classification; the vector kernels below must match these byte for byte */
+
+static inline bool
+scan_is_space (unsigned char c)
+{
+    return mml_char_table[c].flags & MML_CC_SPACE;
+}
+
+static inline bool
+scan_is_newline (unsigned char c)
+{
+    return mml_char_table[c].flags & MML_CC_NEWLINE;
+}
+
+static inline bool
+scan_is_digit (unsigned char c)
+{
+    return mml_char_table[c].flags & MML_CC_DIGIT;
+}
+
+static inline bool
+scan_is_ident (unsigned char c)
+{
+    return mml_char_table[c].flags & MML_CC_IDENT;
+}
+
+/* scalar */
+
+static size_t
+space_scalar (const char *data, size_t offset, size_t size)
+{
+    while (offset < size && scan_is_space (data[offset])) offset++;
+    return offset;
+}
+
+static size_t
+newline_scalar (const char *data, size_t offset, size_t size)
+{
+    while (offset < size && !scan_is_newline (data[offset])) offset++;
+    return offset;
+}
+
+static size_t
+digits_scalar (const char *data, size_t offset, size_t size)
+{
+    while (offset < size && scan_is_digit (data[offset])) offset++;
+    return offset;
+}
+
+static size_t
+ident_scalar (const char *data, size_t offset, size_t size)
+{
+    while (offset < size && scan_is_ident (data[offset])) offset++;
+    return offset;
+}
+
+#ifdef MML_SCAN_X86
+
+/* SSE2 */
+
+/* mask of bytes with (x - lo) <= (hi - lo), unsigned */
+#define SSE2_IN_RANGE(v, lo, hi)                                                                                       \
+    ({                                                                                                                 \
+        __m128i _d = _mm_sub_epi8 ((v), _mm_set1_epi8 ((char)(lo)));                                                   \
+        _mm_cmpeq_epi8 (_mm_min_epu8 (_d, _mm_set1_epi8 ((char)((hi) - (lo)))), _d);                                   \
+    })
+
+static inline __m128i
+sse2_space (__m128i v)
+{
+    return _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 (' ')), SSE2_IN_RANGE (v, '\t', '\r'));
+}
+
+static inline __m128i
+sse2_newline (__m128i v)
+{
+    return _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\n')), _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\r')));
+}
+
+static inline __m128i
+sse2_digit (__m128i v)
+{
+    return SSE2_IN_RANGE (v, '0', '9');
+}
+
+static inline __m128i
+sse2_ident (__m128i v)
+{
+    __m128i alpha = SSE2_IN_RANGE (_mm_or_si128 (v, _mm_set1_epi8 (0x20)), 'a', 'z');
+    __m128i high = _mm_cmplt_epi8 (v, _mm_setzero_si128 ());
+    __m128i under = _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('_'));
+    return _mm_or_si128 (_mm_or_si128 (sse2_digit (v), alpha), _mm_or_si128 (high, under));
+}
+
+/* `run` selects the bytes that continue the run; the scan stops at the first byte outside of it */
+#define SSE2_SCAN(name, run, scalar_test, stop_inside)                                                                 \
+    static size_t name##_sse2 (const char *data, size_t offset, size_t size)                                           \
+    {                                                                                                                  \
+        if (offset < size && !!scalar_test ((unsigned char)data[offset]) == (stop_inside)) return offset;              \
+        while (offset + 16 <= size)                                                                                    \
+        {                                                                                                              \
+            __m128i v = _mm_loadu_si128 ((const __m128i *)(data + offset));                                            \
+            unsigned mask = (unsigned)_mm_movemask_epi8 (run (v));                                                     \
+            if (!(stop_inside)) mask = ~mask & 0xFFFF;                                                                 \
+            if (mask) return offset + __builtin_ctz (mask);                                                            \
+            offset += 16;                                                                                              \
+        }                                                                                                              \
+        return name##_scalar (data, offset, size);                                                                     \
+    }
+
+SSE2_SCAN (space, sse2_space, scan_is_space, false)
+SSE2_SCAN (newline, sse2_newline, scan_is_newline, true)
+SSE2_SCAN (digits, sse2_digit, scan_is_digit, false)
+SSE2_SCAN (ident, sse2_ident, scan_is_ident, false)
+
+/* AVX2 */
+
+#define AVX2_TARGET __attribute__ ((target ("avx2")))
+
+#define AVX2_IN_RANGE(v, lo, hi)                                                                                       \
+    ({                                                                                                                 \
+        __m256i _d = _mm256_sub_epi8 ((v), _mm256_set1_epi8 ((char)(lo)));                                             \
+        _mm256_cmpeq_epi8 (_mm256_min_epu8 (_d, _mm256_set1_epi8 ((char)((hi) - (lo)))), _d);                          \
+    })
+
+AVX2_TARGET static inline __m256i
+avx2_space (__m256i v)
+{
+    return _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 (' ')), AVX2_IN_RANGE (v, '\t', '\r'));
+}
+
+AVX2_TARGET static inline __m256i
+avx2_newline (__m256i v)
+{
+    return _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\n')),
+                            _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\r')));
+}
+
+AVX2_TARGET static inline __m256i
+avx2_digit (__m256i v)
+{
+    return AVX2_IN_RANGE (v, '0', '9');
+}
+
+AVX2_TARGET static inline __m256i
+avx2_ident (__m256i v)
+{
+    __m256i alpha = AVX2_IN_RANGE (_mm256_or_si256 (v, _mm256_set1_epi8 (0x20)), 'a', 'z');
+    __m256i high = _mm256_cmpgt_epi8 (_mm256_setzero_si256 (), v);
+    __m256i under = _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('_'));
+    return _mm256_or_si256 (_mm256_or_si256 (avx2_digit (v), alpha), _mm256_or_si256 (high, under));
+}
+
+#define AVX2_SCAN(name, run, scalar_test, stop_inside)                                                                 \
+    AVX2_TARGET static size_t name##_avx2 (const char *data, size_t offset, size_t size)                               \
+    {                                                                                                                  \
+        if (offset < size && !!scalar_test ((unsigned char)data[offset]) == (stop_inside)) return offset;              \
+        while (offset + 32 <= size)                                                                                    \
+        {                                                                                                              \
+            __m256i v = _mm256_loadu_si256 ((const __m256i *)(data + offset));                                         \
+            uint32_t mask = (uint32_t)_mm256_movemask_epi8 (run (v));                                                  \
+            if (!(stop_inside)) mask = ~mask;                                                                          \
+            if (mask) return offset + __builtin_ctz (mask);                                                            \
+            offset += 32;                                                                                              \
+        }                                                                                                              \
+        return name##_sse2 (data, offset, size);                                                                       \
+    }
+
+AVX2_SCAN (space, avx2_space, scan_is_space, false)
+AVX2_SCAN (newline, avx2_newline, scan_is_newline, true)
+AVX2_SCAN (digits, avx2_digit, scan_is_digit, false)
+AVX2_SCAN (ident, avx2_ident, scan_is_ident, false)
+
+#endif /* MML_SCAN_X86 */
+
+static size_t space_resolve (const char *data, size_t offset, size_t size);
+static size_t newline_resolve (const char *data, size_t offset, size_t size);
+static size_t digits_resolve (const char *data, size_t offset, size_t size);
+static size_t ident_resolve (const char *data, size_t offset, size_t size);
+
+/* The kernels start out as resolvers, which pick an implementation on first use. */
+mml_scan_fn mml_scan_space = space_resolve;
+mml_scan_fn mml_scan_newline = newline_resolve;
+mml_scan_fn mml_scan_digits = digits_resolve;
+mml_scan_fn mml_scan_ident = ident_resolve;
+
+static const char *active_name = "unresolved";
+
+int
+mml_scan_select (mml_scan_impl impl)
+{
+#ifdef MML_SCAN_X86
+    if (impl == MML_SCAN_AUTO) impl = __builtin_cpu_supports ("avx2") ? MML_SCAN_AVX2 : MML_SCAN_SSE2;
+    if (impl == MML_SCAN_AVX2 && !__builtin_cpu_supports ("avx2")) return -1;
+#else
+    if (impl == MML_SCAN_AUTO) impl = MML_SCAN_SCALAR;
+    if (impl != MML_SCAN_SCALAR) return -1;
+#endif
+
+    switch (impl)
+    {
+    case MML_SCAN_SCALAR:
+        mml_scan_space = space_scalar;
+        mml_scan_newline = newline_scalar;
+        mml_scan_digits = digits_scalar;
+        mml_scan_ident = ident_scalar;
+        active_name = "scalar";
+        break;
+#ifdef MML_SCAN_X86
+    case MML_SCAN_SSE2:
+        mml_scan_space = space_sse2;
+        mml_scan_newline = newline_sse2;
+        mml_scan_digits = digits_sse2;
+        mml_scan_ident = ident_sse2;
+        active_name = "sse2";
+        break;
+    case MML_SCAN_AVX2:
+        mml_scan_space = space_avx2;
+        mml_scan_newline = newline_avx2;
+        mml_scan_digits = digits_avx2;
+        mml_scan_ident = ident_avx2;
+        active_name = "avx2";
+        break;
+#endif
+    default: return -1;
+    }
+
+    return 0;
+}
+
+const char *
+mml_scan_name (void)
+{
+    return active_name;
+}
+
+static size_t
+space_resolve (const char *data, size_t offset, size_t size)
+{
+    mml_scan_select (MML_SCAN_AUTO);
+    return mml_scan_space (data, offset, size);
+}
+
+static size_t
+newline_resolve (const char *data, size_t offset, size_t size)
+{
+    mml_scan_select (MML_SCAN_AUTO);
+    return mml_scan_newline (data, offset, size);
+}
+
+static size_t
+digits_resolve (const char *data, size_t offset, size_t size)
+{
+    mml_scan_select (MML_SCAN_AUTO);
+    return mml_scan_digits (data, offset, size);
+}
+
+static size_t
+ident_resolve (const char *data, size_t offset, size_t size)
+{
+    mml_scan_select (MML_SCAN_AUTO);
+    return mml_scan_ident (data, offset, size);
+}
@@ -0,0 +1,321 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright (C) 2026 virtualgrub39
+
+/* Cuts a source into its tracks, for the tools that compile tracks one at a time (`--watch`, the cache).
+ *
+ * Each `;` ends a track, and what a track parses to depends only on its own span and on the macros defined before
+ * it. The split finds, for every track, the definitions it can reach, directly or through other macros, and
+ * fingerprints the track by its span and theirs. A track is parsed alone from a source made of those definitions
+ * followed by its span, which gives the events a parse of the whole source gives it when the source has nothing to
+ * report. The diagnostics can differ: after an error the parser skips to the end of the track, definitions included,
+ * and the split does not follow its recovery. */
+
+#include "mml2midi.h"
+
+#include <string.h>
+
+/* `!name { ... }`, from the `!` up to and including its `}` */
+typedef struct
+{
+    uint32_t begin, end;
+    uint32_t name;        /* index into `names` */
+    uint32_t uses, nuses; /* names used in the body, a range in `names` */
+    int32_t prev;         /* previous definition of the same name, -1 if none */
+} split_def;
+
+typedef struct
+{
+    string_view text; /* without the `@` or `!` */
+    uint64_t hash;
+} split_name;
+
+typedef struct
+{
+    split_def *items;
+    size_t size, capacity;
+} split_defs;
+
+typedef struct
+{
+    split_name *items;
+    size_t size, capacity;
+} split_names;
+
+typedef struct
+{
+    mml_split_track *items;
+    size_t size, capacity;
+} split_track_list;
+
+typedef struct
+{
+    uint32_t *items;
+    size_t size, capacity;
+} split_indices;
+
+typedef struct
+{
+    char *items;
+    size_t size, capacity;
+} split_text;
+
+struct mml_split_index
+{
+    mml_arena arena; /* everything below but `synthetic`, reset by every split */
+    split_defs defs;
+    split_names names;
+    split_track_list tracks;
+    split_indices deps; /* of every track, in turn */
+
+    uint32_t *slots; /* latest definition of each name, plus one; 0 = empty */
+    size_t nslots;
+    uint32_t *marks; /* definitions already collected for track `stamp` */
+    uint32_t stamp;
+
+    split_text synthetic; /* heap, the source of the track being parsed */
+};
+
+static bool
+same_name (const split_name *a, const split_name *b)
+{
+    return a->hash == b->hash && a->text.size == b->text.size && memcmp (a->text.data, b->text.data, a->text.size) == 0;
+}
+
+static int32_t
+latest_definition (const mml_split_index *index, const split_name *name)
+{
+    for (size_t i = name->hash & (index->nslots - 1);; i = (i + 1) & (index->nslots - 1))
+    {
+        uint32_t slot = index->slots[i];
+        if (!slot) return -1;
+        if (same_name (&index->names.items[index->defs.items[slot - 1].name], name)) return slot - 1;
+    }
+}
+
+static void
+record_definition (mml_split_index *index, uint32_t def)
+{
+    const split_name *name = &index->names.items[index->defs.items[def].name];
+    index->defs.items[def].prev = -1;
+    if (name->text.size == 0) return; /* reported by the parser, and never defined */
+
+    size_t i = name->hash & (index->nslots - 1);
+    for (; index->slots[i]; i = (i + 1) & (index->nslots - 1))
+    {
+        if (same_name (&index->names.items[index->defs.items[index->slots[i] - 1].name], name))
+        {
+            index->defs.items[def].prev = index->slots[i] - 1;
+            break;
+        }
+    }
+    index->slots[i] = def + 1;
+}
+
+static void
+add_name (mml_split_index *index, const char *data, token t)
+{
+    string_view text = { .data = data + t.offset + 1, .size = t.length - 1 };
+    split_name name = { .text = text, .hash = mml_hash64 (text.data, text.size, 0) };
+    da_append (&index->arena, &index->names, name);
+}
+
+/* Adds every definition of `name` before definition `limit`, and everything those depend on in turn. All of them,
+ * not only the latest: an empty definition defines nothing, and leaves the one before it in place. */
+static void
+collect (mml_split_index *index, const split_name *name, uint32_t limit)
+{
+    int32_t d = latest_definition (index, name);
+    while (d >= 0 && (uint32_t)d >= limit) d = index->defs.items[d].prev;
+
+    for (; d >= 0 && index->marks[d] != index->stamp; d = index->defs.items[d].prev)
+    {
+        index->marks[d] = index->stamp;
+        da_append (&index->arena, &index->deps, (uint32_t)d);
+
+        const split_def *def = &index->defs.items[d];
+        for (uint32_t u = 0; u < def->nuses; ++u) collect (index, &index->names.items[def->uses + u], d);
+    }
+}
+
+static int
+compare_u32 (const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Finds what the track depends on, from the names used or defined in its span, and fingerprints it */
+static void
+add_track (mml_split_index *index, const char *data, mml_split_track track, uint32_t first_def, uint32_t names)
+{
+    index->stamp += 1;
+    track.deps = index->deps.size;
+    for (uint32_t n = names; n < index->names.size; ++n) collect (index, &index->names.items[n], first_def);
+    track.ndeps = index->deps.size - track.deps;
+    if (track.ndeps > 1) qsort (index->deps.items + track.deps, track.ndeps, sizeof *index->deps.items, compare_u32);
+
+    /* the index is part of the fingerprint: it is the track's channel */
+    uint64_t hash = mml_hash64 (data + track.begin, track.end - track.begin, index->tracks.size);
+    for (uint32_t i = 0; i < track.ndeps; ++i)
+    {
+        const split_def *def = &index->defs.items[index->deps.items[track.deps + i]];
+        hash = mml_hash64 (data + def->begin, def->end - def->begin, hash);
+    }
+    track.fingerprint = hash;
+
+    da_append (&index->arena, &index->tracks, track);
+}
+
+/* Bytes that can start a token the split looks at. Everything between two of them lexes to tokens that cannot hide
+ * one, so the lexer only runs from these. A UTF-8 lead byte is one of them: the lexer takes the bytes that follow
+ * it along, whatever they are. */
+#define ST(c) ((c) >= 0xC0 || (c) == ';' || (c) == '!' || (c) == '@' || (c) == '}' || (c) == '%')
+#define ST4(c) ST (c), ST ((c) + 1), ST ((c) + 2), ST ((c) + 3)
+#define ST16(c) ST4 (c), ST4 ((c) + 4), ST4 ((c) + 8), ST4 ((c) + 12)
+#define ST64(c) ST16 (c), ST16 ((c) + 16), ST16 ((c) + 32), ST16 ((c) + 48)
+
+static const bool starts_token[256] = { ST64 (0), ST64 (64), ST64 (128), ST64 (192) };
+
+static int
+split_tracks (mml_split_index *index, const char *data, size_t size)
+{
+    mml_lexer lexer;
+    if (mml_lexer_init (&lexer, data, size) != 0) return -1;
+
+    /* every definition starts with a '!', so that bounds their number */
+    size_t ndefs = 0;
+    for (const char *p = data, *end = data + size; p < end && (p = memchr (p, '!', end - p)); ++p) ndefs++;
+
+    for (index->nslots = 64; index->nslots < ndefs * 2;) index->nslots *= 2;
+    index->slots = mml_arena_alloc (&index->arena, index->nslots * sizeof *index->slots);
+    memset (index->slots, 0, index->nslots * sizeof *index->slots);
+    index->marks = mml_arena_alloc (&index->arena, (ndefs + 1) * sizeof *index->marks);
+    memset (index->marks, 0, (ndefs + 1) * sizeof *index->marks);
+    index->stamp = 0;
+
+    mml_split_track track = { 0 };
+    uint32_t first_def = 0, names = 0; /* of the track being scanned */
+    int32_t open = -1;                 /* definition whose `}` is still ahead */
+
+    for (;;)
+    {
+        while (lexer.offset < size && !starts_token[(unsigned char)data[lexer.offset]]) lexer.offset++;
+
+        token t = mml_read_next_token (&lexer);
+        switch (t.kind)
+        {
+        case MML_EXPANSION: add_name (index, data, t); break;
+        case MML_DEFINITION: {
+            if (open >= 0 || mml_read_next_token (&lexer).kind != MML_LBRACE) return -1;
+
+            split_def def = { .begin = t.offset, .name = index->names.size, .uses = index->names.size + 1 };
+            add_name (index, data, t);
+            da_append (&index->arena, &index->defs, def);
+            open = index->defs.size - 1;
+            break;
+        }
+        case MML_RBRACE:
+            if (open >= 0)
+            {
+                /* defined once its body is parsed, so that `@self` in the body is the previous definition */
+                split_def *def = &index->defs.items[open];
+                def->end = t.offset + t.length;
+                def->nuses = index->names.size - def->uses;
+                record_definition (index, open);
+                open = -1;
+            }
+            break;
+        case MML_SCOLON:
+        case MML_EOF: {
+            if (open >= 0) return -1;
+
+            track.end = t.offset + t.length;
+
+            /* a `;` always makes a track; what trails the last one is a track if it has any tokens */
+            mml_lexer rest = { .data = data + track.begin, .size = track.end - track.begin };
+            if (t.kind == MML_SCOLON || mml_read_next_token (&rest).kind != MML_EOF)
+                add_track (index, data, track, first_def, names);
+            if (t.kind == MML_EOF) return 0;
+
+            track = (mml_split_track){ .begin = track.end };
+            first_def = index->defs.size;
+            names = index->names.size;
+            break;
+        }
+        default: break;
+        }
+    }
+}
+
+int
+mml_split_source (mml_split *split, const char *data, size_t size)
+{
+    if (!split->index) split->index = calloc (1, sizeof *split->index);
+
+    mml_split_index *index = split->index;
+    mml_arena_reset (&index->arena);
+    index->defs = (split_defs){ 0 };
+    index->names = (split_names){ 0 };
+    index->tracks = (split_track_list){ 0 };
+    index->deps = (split_indices){ 0 };
+
+    int result = split_tracks (index, data, size);
+
+    split->data = data;
+    split->size = size;
+    split->tracks = result == 0 ? index->tracks.items : NULL;
+    split->ntracks = result == 0 ? index->tracks.size : 0;
+    return result;
+}
+
+int
+mml_split_parse (mml_split *split, size_t track, mml_song *song)
+{
+    mml_split_index *index = split->index;
+    const mml_split_track *t = &split->tracks[track];
+
+    /* the dependencies, each on a line of its own, then the span */
+    index->synthetic.size = 0;
+    for (uint32_t i = 0; i < t->ndeps; ++i)
+    {
+        const split_def *def = &index->defs.items[index->deps.items[t->deps + i]];
+        da_append_many (NULL, &index->synthetic, split->data + def->begin, def->end - def->begin);
+        da_append (NULL, &index->synthetic, '\n');
+    }
+    size_t prefix = index->synthetic.size;
+    da_append_many (NULL, &index->synthetic, split->data + t->begin, t->end - t->begin);
+
+    mml_song_reset (song);
+    mml_lexer lexer;
+    if (mml_lexer_init (&lexer, index->synthetic.items, index->synthetic.size) != 0) return -1;
+    if (mml_parse (&lexer, song) < 0) return -1;
+
+    /* what was reported in the dependencies belongs to the tracks they are in */
+    mml_diagnostics *diagnostics = &song->diagnostics;
+    size_t kept = 0;
+    diagnostics->errors = 0;
+    for (size_t i = 0; i < diagnostics->size; ++i)
+    {
+        mml_diagnostic d = diagnostics->items[i];
+        if (d.offset < prefix) continue;
+
+        d.offset = d.offset - prefix + t->begin;
+        diagnostics->items[kept++] = d;
+        diagnostics->errors += d.severity == MML_SEVERITY_ERROR;
+    }
+    diagnostics->size = kept;
+
+    return diagnostics->errors;
+}
+
+void
+mml_split_free (mml_split *split)
+{
+    if (split->index)
+    {
+        mml_arena_free (&split->index->arena);
+        free (split->index->synthetic.items);
+        free (split->index);
+    }
+    *split = (mml_split){ 0 };
+}
@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright (C) 2026 virtualgrub39
+
+#define _GNU_SOURCE /* gettid */
+
+#include "mml2midi.h"
+
+#if MML_STATS
+
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+mml_stats_t mml_stats;
+
+uint64_t
+mml_stats_now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static long
+peak_rss_kb (void)
+{
+    struct rusage usage;
+    if (getrusage (RUSAGE_SELF, &usage) != 0) return 0;
+    return usage.ru_maxrss;
+}
+
+void
+mml_stats_span (const char *name, int track, uint64_t start_ns)
+{
+    if (!mml_stats.enabled) return;
+
+    size_t i = atomic_fetch_add (&mml_stats.nspans, 1);
+    if (i >= MML_STATS_MAX_SPANS) return;
+
+    mml_stats.spans[i] = (mml_span){
+        .name = name,
+        .track = track,
+        .tid = gettid (),
+        .start_ns = start_ns,
+        .end_ns = mml_stats_now (),
+        .reallocs = atomic_load_explicit (&mml_stats.reallocs, memory_order_relaxed),
+        .bytes_copied = atomic_load_explicit (&mml_stats.bytes_copied, memory_order_relaxed),
+        .rss_kb = track < 0 ? peak_rss_kb () : 0,
+    };
+}
+
+static size_t
+span_count (void)
+{
+    size_t n = atomic_load (&mml_stats.nspans);
+    return n < MML_STATS_MAX_SPANS ? n : MML_STATS_MAX_SPANS;
+}
+
+void
+mml_stats_print (FILE *out)
+{
+    size_t nspans = span_count ();
+
+    /* stages run one after the other on the main thread, so the counters they moved are the difference from the
+     * end of the previous stage */
+    fprintf (out, "%-16s %10s %10s %14s %10s\n", "stage", "wall ms", "reallocs", "bytes copied", "peak RSS");
+    size_t reallocs = 0, bytes_copied = 0;
+    for (size_t i = 0; i < nspans; ++i)
+    {
+        const mml_span *span = &mml_stats.spans[i];
+        if (span->track >= 0) continue;
+
+        fprintf (out, "%-16s %10.3f %10zu %14zu %7ld KiB\n", span->name, (span->end_ns - span->start_ns) / 1e6,
+                 span->reallocs - reallocs, span->bytes_copied - bytes_copied, span->rss_kb);
+        reallocs = span->reallocs;
+        bytes_copied = span->bytes_copied;
+    }
+
+    fprintf (out, "\nbytes read       %zu\n", atomic_load (&mml_stats.bytes_read));
+    fprintf (out, "tokens           %zu\n", atomic_load (&mml_stats.tokens));
+    fprintf (out, "events           %zu parsed, %zu after expansion\n", atomic_load (&mml_stats.events_parsed),
+             atomic_load (&mml_stats.events_expanded));
+    fprintf (out, "bytes copied     %zu (da_append_many)\n", atomic_load (&mml_stats.bytes_copied));
+    fprintf (out, "reallocs         %zu\n", atomic_load (&mml_stats.reallocs));
+    fprintf (out, "peak RSS         %ld KiB\n", peak_rss_kb ());
+
+    for (size_t i = 0; i < nspans; ++i)
+    {
+        const mml_span *span = &mml_stats.spans[i];
+        if (span->track < 0) continue;
+
+        fprintf (out, "track %-10d %10.3f ms %10zu SMF bytes\n", span->track, (span->end_ns - span->start_ns) / 1e6,
+                 atomic_load (&mml_stats.track_bytes[span->track % MML_STATS_MAX_TRACKS]));
+    }
+}
+
+int
+mml_stats_write_trace (const char *path)
+{
+    FILE *out = fopen (path, "w");
+    if (!out) return -1;
+
+    size_t nspans = span_count ();
+    uint64_t origin = UINT64_MAX;
+    for (size_t i = 0; i < nspans; ++i)
+        if (mml_stats.spans[i].start_ns < origin) origin = mml_stats.spans[i].start_ns;
+
+    /* complete events ("ph": "X"), with timestamps in microseconds */
+    fprintf (out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (size_t i = 0; i < nspans; ++i)
+    {
+        const mml_span *span = &mml_stats.spans[i];
+        fprintf (out, "%s  {\"name\": \"%s\", \"cat\": \"mml\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, ",
+                 i ? ",\n" : "", span->name, (int)getpid (), span->tid);
+        fprintf (out, "\"ts\": %.3f, \"dur\": %.3f, \"args\": {", (span->start_ns - origin) / 1e3,
+                 (span->end_ns - span->start_ns) / 1e3);
+        if (span->track >= 0)
+            fprintf (out, "\"track\": %d, \"smf_bytes\": %zu", span->track,
+                     atomic_load (&mml_stats.track_bytes[span->track % MML_STATS_MAX_TRACKS]));
+        else
+            fprintf (out, "\"reallocs\": %zu, \"bytes_copied\": %zu, \"peak_rss_kb\": %ld", span->reallocs,
+                     span->bytes_copied, span->rss_kb);
+        fprintf (out, "}}");
+    }
+    fprintf (out, "\n]}\n");
+
+    return fclose (out) == 0 ? 0 : -1;
+}
+
+#endif
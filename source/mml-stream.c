@@ -0,0 +1,245 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright (C) 2026 virtualgrub39
+
+/* Streaming mode: compiles stdin to stdout one track at a time, writing each track's MTrk chunk as soon as its `;`
+ * arrives, while the rest of the input is still being read.
+ *
+ * usage: mml2midi --stream [--tracks N] < input.mml > output.mid
+ *
+ * Only the track being read is kept, and the macros the tracks before it defined: each track is parsed alone with
+ * `mml_parse_piece`, which gives it the events and diagnostics a parse of the whole source gives it. Memory is bounded
+ * by the largest track and the macros rather than by the song, and each track costs the same whatever came before.
+ *
+ * The SMF header goes out first, and it holds the number of tracks. When stdout can seek, the count is patched in
+ * once the input ends; otherwise (a pipe, a socket) it must be given up front with `--tracks`. Either way the header
+ * ends up counting the chunks that were written, even when an error stops the output early. */
+
+#define _DEFAULT_SOURCE
+
+#include "mml2midi.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STREAM_READ_SIZE (64 * 1024)
+
+typedef struct
+{
+    char *items;
+    size_t size, capacity;
+} stream_text;
+
+typedef struct
+{
+    stream_text text;      /* heap: the input from the start of the track being read */
+    size_t scanned;        /* end of the last token read */
+    bool tokens;           /* whether the track has any */
+    unsigned line, column; /* of its start in the input */
+
+    mml_song song;
+    mml_macros macros;     /* of the tracks compiled so far */
+    mml_track_bytes bytes; /* from the song's arena */
+    size_t ntracks;        /* as many as go in the SMF */
+    size_t written;        /* chunks written */
+    size_t declared;       /* `--tracks` */
+    bool patch;            /* no `--tracks`: the count is patched in at the end */
+    size_t errors;
+    int out;
+    bool failed; /* writing the output */
+} stream;
+
+/* A track with nothing but its end, to make up the count declared with `--tracks` on an output that cannot seek */
+static const uint8_t EMPTY_TRACK[] = { 0x00, 0xFF, 0x2F, 0x00 };
+
+static void
+print_diagnostics (const stream *s, const char *span, size_t size)
+{
+    /* positions within the span, then within the input; the first line of the span is the rest of a line */
+    const mml_diagnostics *diagnostics = &s->song.diagnostics;
+    for (size_t i = 0; i < diagnostics->size; ++i)
+    {
+        const mml_diagnostic *d = &diagnostics->items[i];
+        unsigned line, column;
+        mml_source_position (span, size, d->offset, &line, &column);
+        if (line == 1) column += s->column - 1;
+        fprintf (stderr, "-:%u:%u: %s: %s\n", s->line + line - 1, column,
+                 d->severity == MML_SEVERITY_ERROR ? "error" : "warning", d->message);
+    }
+}
+
+/* Compiles the track that ends at `end`, writes it, and drops its text */
+static void
+compile_track (stream *s, size_t end)
+{
+    const char *span = s->text.items;
+
+    mml_lexer lexer;
+    mml_song_reset (&s->song);
+    if (mml_lexer_init (&lexer, span, end) != 0 || mml_parse_piece (&lexer, &s->song, &s->macros) < 0)
+    {
+        perror ("mml: Failed to parse track");
+        s->errors += 1;
+    }
+    print_diagnostics (s, span, end);
+    s->errors += s->song.diagnostics.errors;
+
+    /* as the writer does: one track per `;`, and as many as there are channels; after an error, the output is
+     * abandoned, but the input is still compiled for its diagnostics */
+    if (s->song.events.size > 0 && s->ntracks < MML_SMF_MAX_TRACKS)
+    {
+        if (s->errors == 0 && !s->failed && (s->patch || s->ntracks < s->declared))
+        {
+            s->bytes = (mml_track_bytes){ 0 };
+            mml_encode_track (&s->song, 0, s->ntracks, &s->song.arena, &s->bytes);
+            if (mml_write_track_fd (s->out, &s->bytes) != 0)
+                s->failed = true;
+            else
+                s->written += 1;
+        }
+        s->ntracks += 1;
+    }
+
+    /* where the next track starts in the input */
+    unsigned line, column;
+    mml_source_position (span, end, end, &line, &column);
+    s->column = line == 1 ? s->column + column - 1 : column;
+    s->line += line - 1;
+
+    /* what was read past the track moves to the front */
+    memmove (s->text.items, s->text.items + end, s->text.size - end);
+    s->text.size -= end;
+    s->scanned = 0;
+    s->tokens = false;
+}
+
+/* Reads the tokens that came in, and compiles every track they complete. A token that reaches the end of what was
+ * read may go on in the next read, so it is left for then, unless it is a `;`, or the input has ended. */
+static void
+scan (stream *s, bool eof)
+{
+    mml_lexer lexer = { .data = s->text.items, .offset = s->scanned, .size = s->text.size };
+
+    for (;;)
+    {
+        token t = mml_read_next_token (&lexer);
+        if (t.kind == MML_EOF)
+        {
+            /* what trails the last `;` is a track if it has any tokens */
+            if (eof && s->tokens) compile_track (s, s->text.size);
+            return;
+        }
+        if (!eof && t.kind != MML_SCOLON && t.offset + t.length == s->text.size) return;
+
+        s->scanned = t.offset + t.length;
+        s->tokens = true;
+
+        if (t.kind == MML_SCOLON)
+        {
+            compile_track (s, s->scanned);
+            lexer = (mml_lexer){ .data = s->text.items, .offset = 0, .size = s->text.size };
+        }
+    }
+}
+
+/* Makes the header count the chunks that were written: patched when the output can seek, or else made up to the
+ * count it declared with empty tracks */
+static void
+finish_header (stream *s, off_t header)
+{
+    if (s->failed) return;
+
+    if (header >= 0)
+    {
+        if ((s->patch || s->written != s->declared) && mml_write_ntracks_fd (s->out, header, s->written) != 0)
+            s->failed = true;
+        return;
+    }
+
+    mml_track_bytes empty = { .items = (uint8_t *)EMPTY_TRACK, .size = sizeof EMPTY_TRACK };
+    for (size_t i = s->written; i < s->declared && !s->failed; ++i)
+        if (mml_write_track_fd (s->out, &empty) != 0) s->failed = true;
+}
+
+static void
+usage (void)
+{
+    fprintf (stderr, "usage: mml2midi --stream [--tracks N] < input.mml > output.mid\n");
+}
+
+int
+mml_stream_main (int argc, char *argv[])
+{
+    stream s = { .line = 1, .column = 1, .out = STDOUT_FILENO, .patch = true };
+
+    for (int arg = 1; arg < argc; ++arg)
+    {
+        if (strcmp (argv[arg], "--tracks") == 0 && arg + 1 < argc)
+            s.declared = strtoul (argv[++arg], NULL, 10), s.patch = false;
+        else
+        {
+            usage ();
+            return 1;
+        }
+    }
+
+    /* the count is patched into the header, at the position the output starts at */
+    off_t header = lseek (s.out, 0, SEEK_CUR);
+    if (s.patch && header < 0)
+    {
+        fprintf (stderr, "mml: the output cannot seek, the number of tracks must be given with --tracks\n");
+        return 1;
+    }
+    if (s.declared > MML_SMF_MAX_TRACKS)
+    {
+        fprintf (stderr, "mml: --tracks %zu, a song has at most %d tracks\n", s.declared, MML_SMF_MAX_TRACKS);
+        return 1;
+    }
+
+    if (mml_write_header_fd (s.out, s.patch ? 0 : s.declared) != 0) s.failed = true;
+
+    for (bool eof = false; !eof && !s.failed;)
+    {
+        da_reserve (NULL, &s.text, s.text.size + STREAM_READ_SIZE);
+        ssize_t n = read (STDIN_FILENO, s.text.items + s.text.size, STREAM_READ_SIZE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 || s.text.size + n > UINT32_MAX)
+        {
+            if (n >= 0) errno = EFBIG;
+            perror ("mml: Failed to read input");
+            finish_header (&s, header);
+            free (s.text.items);
+            mml_song_free (&s.song);
+            mml_macros_free (&s.macros);
+            return 2;
+        }
+
+        s.text.size += n;
+        eof = n == 0;
+        scan (&s, eof);
+    }
+
+    finish_header (&s, header);
+
+    free (s.text.items);
+    mml_song_free (&s.song);
+    mml_macros_free (&s.macros);
+
+    if (s.failed)
+    {
+        perror ("mml: Failed to write output");
+        return 5;
+    }
+    if (s.errors > 0)
+    {
+        fprintf (stderr, "-: %zu error%s\n", s.errors, s.errors == 1 ? "" : "s");
+        return 4;
+    }
+    if (!s.patch && s.ntracks != s.declared)
+    {
+        fprintf (stderr, "mml: --tracks %zu given, the input has %zu\n", s.declared, s.ntracks);
+        return 5;
+    }
+
+    return 0;
+}
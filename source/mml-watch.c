@@ -0,0 +1,264 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Copyright (C) 2026 virtualgrub39
+
+/* Watch mode: recompiles the input every time it is saved, reusing every track that did not change.
+ *
+ * usage: mml2midi --watch input.mml output.mid
+ *
+ * The source is cut into its tracks with `mml_split_source`. Tracks whose fingerprint is unchanged keep their encoded
+ * MTrk data from the previous build; a changed track is parsed and encoded on its own, and the output is byte-for-byte
+ * what a full compile gives. Once any track has something to report, the whole source is parsed again, for the
+ * diagnostics: the parser's recovery from an error can skip definitions that the split counts. */
+
+#define _DEFAULT_SOURCE
+
+#include "mml2midi.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WATCH_DEBOUNCE_MS 30
+
+/* What the previous builds left for one track index */
+typedef struct
+{
+    bool valid;
+    uint64_t fingerprint;
+    bool has_events;       /* only the last track can lack events, when no `;` ends it */
+    bool reported;         /* had diagnostics, which only a parse of the whole source gets right */
+    mml_track_bytes bytes; /* heap; empty for tracks past MML_SMF_MAX_TRACKS */
+} watch_track;
+
+typedef struct
+{
+    watch_track *items;
+    size_t size, capacity;
+} watch_tracks;
+
+typedef struct
+{
+    const char *in_path, *out_path;
+
+    mml_split split;
+    watch_tracks tracks; /* heap, kept across builds */
+    mml_song song;
+} watch;
+
+static double
+now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+track_clear (watch_track *track)
+{
+    free (track->bytes.items);
+    *track = (watch_track){ 0 };
+}
+
+static void
+compile_track (watch *w, size_t index, watch_track *track)
+{
+    track_clear (track);
+    track->reported = mml_split_parse (&w->split, index, &w->song) != 0 || w->song.diagnostics.size > 0;
+    if (track->reported) return;
+
+    track->has_events = w->song.events.size > 0;
+    if (track->has_events && index < MML_SMF_MAX_TRACKS) mml_encode_track (&w->song, 0, index, NULL, &track->bytes);
+}
+
+static int
+write_output (const watch *w, const mml_track_bytes *tracks, size_t ntracks)
+{
+    /* written aside and renamed over the output, so that a player never picks up half a file */
+    size_t size = strlen (w->out_path) + sizeof ".tmp";
+    char *tmp = malloc (size);
+    snprintf (tmp, size, "%s.tmp", w->out_path);
+
+    int fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    int result = fd < 0 ? -1 : mml_write_tracks_fd (fd, tracks, ntracks);
+    if (fd >= 0 && close (fd) != 0) result = -1;
+    if (result == 0 && rename (tmp, w->out_path) != 0) result = -1;
+    if (result != 0 && fd >= 0) unlink (tmp);
+
+    free (tmp);
+    return result;
+}
+
+/* The whole pipeline, for sources the split cannot handle or gets the diagnostics of wrong */
+static int
+build_full (watch *w, const mml_source *source)
+{
+    mml_lexer lexer;
+    if (mml_lexer_init (&lexer, source->data, source->size) != 0) return -1;
+
+    mml_song_reset (&w->song);
+    int errors = mml_parse (&lexer, &w->song);
+    mml_diagnostics_print (stderr, w->in_path, source->data, source->size, &w->song.diagnostics);
+    if (errors > 0)
+    {
+        fprintf (stderr, "%s: %d error%s\n", w->in_path, errors, errors == 1 ? "" : "s");
+        return 0;
+    }
+
+    size_t size = strlen (w->out_path) + sizeof ".tmp";
+    char *tmp = malloc (size);
+    snprintf (tmp, size, "%s.tmp", w->out_path);
+    int result = mml_write_midi (&w->song, tmp, 0);
+    if (result == 0 && rename (tmp, w->out_path) != 0) result = -1;
+    free (tmp);
+
+    return result;
+}
+
+static int
+build (watch *w)
+{
+    double start = now ();
+
+    /* read, not mapped: an editor that truncates the file while it is being compiled must not fault us */
+    mml_source source;
+    if (mml_source_open (&source, w->in_path, MML_SOURCE_NOMAP) != 0) return -1;
+
+    if (mml_split_source (&w->split, source.data, source.size) != 0)
+    {
+        int result = build_full (w, &source);
+        mml_source_close (&source);
+        fprintf (stderr, "mml: %s: full rebuild in %.2f ms\n", w->in_path, (now () - start) * 1e3);
+        return result;
+    }
+
+    size_t nsplit = w->split.ntracks, rebuilt = 0;
+    for (size_t i = nsplit; i < w->tracks.size; ++i) track_clear (&w->tracks.items[i]);
+    da_reserve (NULL, &w->tracks, nsplit);
+    for (size_t i = w->tracks.size; i < nsplit; ++i) w->tracks.items[i] = (watch_track){ 0 };
+    w->tracks.size = nsplit;
+
+    mml_track_bytes output[MML_SMF_MAX_TRACKS];
+    size_t ntracks = 0;
+    bool whole = false;
+
+    for (size_t i = 0; i < nsplit; ++i)
+    {
+        const mml_split_track *span = &w->split.tracks[i];
+        watch_track *track = &w->tracks.items[i];
+
+        if (!track->valid || track->fingerprint != span->fingerprint)
+        {
+            compile_track (w, i, track);
+            track->valid = true;
+            track->fingerprint = span->fingerprint;
+            rebuilt += 1;
+        }
+
+        whole = whole || track->reported;
+        if (track->has_events && ntracks < MML_SMF_MAX_TRACKS) output[ntracks++] = track->bytes;
+    }
+
+    int result;
+    if (whole)
+    {
+        /* the tracks are kept all the same: the clean ones are still right for the next build */
+        result = build_full (w, &source);
+        fprintf (stderr, "mml: %s: full rebuild in %.2f ms\n", w->in_path, (now () - start) * 1e3);
+    }
+    else
+    {
+        result = write_output (w, output, ntracks);
+        fprintf (stderr, "mml: %s: %zu/%zu tracks rebuilt in %.2f ms\n", w->in_path, rebuilt, nsplit,
+                 (now () - start) * 1e3);
+    }
+
+    mml_source_close (&source);
+    return result;
+}
+
+/* Blocks until the input is written or moved into place, then waits for the writes to settle */
+static int
+wait_for_change (int fd, const char *name)
+{
+    char buffer[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    bool changed = false;
+    int timeout = -1;
+
+    for (;;)
+    {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ready = poll (&pfd, 1, timeout);
+        if (ready < 0 && errno != EINTR) return -1;
+        if (ready == 0) return 0; /* quiet for WATCH_DEBOUNCE_MS */
+        if (ready < 0) continue;
+
+        ssize_t n = read (fd, buffer, sizeof buffer);
+        if (n < 0 && errno != EINTR && errno != EAGAIN) return -1;
+
+        for (ssize_t at = 0; at < n;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)(buffer + at);
+            if (event->len && strcmp (event->name, name) == 0) changed = true;
+            at += sizeof *event + event->len;
+        }
+
+        if (changed) timeout = WATCH_DEBOUNCE_MS;
+    }
+}
+
+static void
+usage (void)
+{
+    fprintf (stderr, "usage: mml2midi --watch input.mml output.mid\n");
+}
+
+int
+mml_watch_main (int argc, char *argv[])
+{
+    if (argc != 3 || strcmp (argv[1], "-") == 0 || strcmp (argv[2], "-") == 0)
+    {
+        usage ();
+        return 1;
+    }
+
+    watch w = { .in_path = argv[1], .out_path = argv[2] };
+
+    /* editors rarely write in place: most write a new file and rename it over the old one, so the directory is
+     * watched rather than the file */
+    const char *slash = strrchr (w.in_path, '/');
+    const char *name = slash ? slash + 1 : w.in_path;
+    char *dir = slash ? strndup (w.in_path, slash - w.in_path + 1) : strdup (".");
+
+    int fd = inotify_init1 (IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch (fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        perror ("mml: Failed to watch input");
+        free (dir);
+        return 2;
+    }
+    free (dir);
+
+    int result = 0;
+    for (;;)
+    {
+        if (build (&w) != 0) perror ("mml: Failed to rebuild");
+        if (wait_for_change (fd, name) != 0)
+        {
+            perror ("mml: Failed to watch input");
+            result = 2;
+            break;
+        }
+    }
+
+    close (fd);
+    for (size_t i = 0; i < w.tracks.size; ++i) track_clear (&w.tracks.items[i]);
+    free (w.tracks.items);
+    mml_split_free (&w.split);
+    mml_song_free (&w.song);
+    return result;
+}
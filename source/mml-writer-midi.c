@@ -1,95 +1,39 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 // Copyright (C) 2026 virtualgrub39
 
+#define _DEFAULT_SOURCE
+
 #include "mml2midi.h"
 #include <assert.h>
-#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
-#include <uchar.h>
+#include <string.h>
+#include <unistd.h>
 
 #define MIDI_WRITER_IMPLEMENTATION
 #include <midi-codec/midi-writer.h>
 #define MIDI_PARSER_IMPLEMENTATION
 #include <midi-codec/midi-parser.h>
 
-static int
-pitch_to_midi_note (char32_t pitch, uint8_t octave, int accidental)
-{
-    pitch = tolower (pitch);
-
-    int base_note;
-    switch (pitch)
-    {
-    case 'c': base_note = 0; break;
-    case 'd': base_note = 2; break;
-    case 'e': base_note = 4; break;
-    case 'f': base_note = 5; break;
-    case 'g': base_note = 7; break;
-    case 'a': base_note = 9; break;
-    case 'b': base_note = 11; break;
-    case 'r': return -1;
-    default: return -1;
-    }
-
-    int midi_note = (octave + 1) * 12 + base_note + accidental;
-
-    if (midi_note < 0) midi_note = 0;
-    if (midi_note > 127) midi_note = 127;
-
-    return midi_note;
-}
-
-static uint32_t
-calculate_duration (uint32_t length, uint32_t dots, uint32_t ticks_per_quarter)
-{
-    if (length == 0) return 0;
-
-    uint32_t base_ticks = (4 * ticks_per_quarter) / length;
-
-    uint32_t total_ticks = base_ticks;
-    uint32_t dot_add = base_ticks;
-
-    for (uint32_t i = 0; i < dots; i++)
-    {
-        dot_add /= 2;
-        total_ticks += dot_add;
-    }
-
-    return total_ticks;
-}
-
 typedef struct
 {
-    midi_writer_t *mw;
+    mml_track_bytes *out;
     uint8_t last_status;
-    const mml_sequence *events;
-    size_t offset;
-
-    uint32_t tempo_us;
-    uint32_t ticks_per_quarter;
-    size_t current_tick;
-    uint32_t default_length;
-    int octave;
-    uint8_t velocity;
     uint8_t channel;
-
-    bool active_notes[128];
+    uint32_t tick;    /* of the latest event encoded */
+    mml_arena *arena; /* backs `out` */
 } mml_context;
 
-void
-ctx_reset (mml_context *ctx, uint32_t ticks_per_quarter, uint8_t channel)
+static void
+track_append (mml_context *ctx, const uint8_t *data, size_t len)
 {
-    ctx->ticks_per_quarter = ticks_per_quarter;
-    ctx->current_tick = 0;
-    ctx->default_length = 4; /* Quarter note */
-    ctx->tempo_us = 500000;  /* 120 BPM */
-    ctx->octave = 4;         /* Middle octave */
-    ctx->velocity = 100;     /* Default velocity */
-    ctx->channel = channel;  /* Assign channel */
+    da_append_many (ctx->arena, ctx->out, data, len);
 }
 
 int
-write_tempo (midi_writer_t *mw, uint32_t delta, uint32_t tempo_us)
+write_tempo (mml_context *ctx, uint32_t delta, uint32_t tempo_us)
 {
     const uint8_t data[] = {
         (tempo_us >> 16) & 0xff,
@@ -112,7 +56,9 @@ write_tempo (midi_writer_t *mw, uint32_t delta, uint32_t tempo_us)
     int result = track_event_to_bytes (&ev, buffer);
     if (result < 0) return -1;
 
-    return mw_track_append (mw, buffer, result);
+    track_append (ctx, buffer, result);
+    ctx->last_status = 0; /* meta events cancel running status: the next channel message spells its status out */
+    return 0;
 }
 
 int
@@ -121,20 +67,47 @@ write_midi (mml_context *ctx, uint32_t delta, midi_event_t midiev)
     uint8_t buffer[16];
     uint8_t status = (midiev.kind << 4) | (midiev.channel & 0x0F);
 
-    int n = midi_vlq_encode (delta, buffer);
+    int n = midi_vlq_encode_wide (delta, buffer);
     if (n < 0) return -1;
 
     int result = midi_event_to_bytes (&midiev, buffer + n, ctx->last_status == status);
     if (result < 0) return -1;
 
-    mw_track_append (ctx->mw, buffer, n + result);
+    track_append (ctx, buffer, n + result);
 
     ctx->last_status = status;
     return n + result;
 }
 
+/* Fast path for the bulk of every track: a note on, or a note off sent as note on with velocity 0, encoded
+ * straight into the track buffer. Both share one status byte, so after the first one running status drops it. */
+static inline void
+emit_note (mml_context *ctx, uint32_t delta, uint8_t note, uint8_t velocity)
+{
+    mml_track_bytes *out = ctx->out;
+    /* delta (stored MIDI_VLQ_WIDE wide, at most 5 bytes used), status, note, velocity */
+    da_reserve (ctx->arena, out, out->size + MIDI_VLQ_WIDE + 3);
+
+    uint8_t *p = out->items + out->size;
+    if (delta < 0x80)
+        *p++ = delta;
+    else
+        p += midi_vlq_encode_wide (delta, p);
+
+    uint8_t status = (MIDI_NOTE_ON << 4) | (ctx->channel & 0x0F);
+    if (status != ctx->last_status)
+    {
+        *p++ = status;
+        ctx->last_status = status;
+    }
+
+    p[0] = note;
+    p[1] = velocity;
+    out->size = p + 2 - out->items;
+}
+
 int
-write_end_of_track (midi_writer_t *mw, uint32_t delta)
+write_end_of_track (mml_context *ctx, uint32_t delta)
 {
     track_event_t ev = 
     {
@@ -152,176 +125,167 @@ write_end_of_track (midi_writer_t *mw, uint32_t delta)
     int result = track_event_to_bytes (&ev, buffer);
     if (result < 0) return -1;
 
-    return mw_track_append (mw, buffer, result);
+    track_append (ctx, buffer, result);
+    return 0;
 }
 
-void
-process_control (mml_context *ctx, char32_t cmd, unsigned arg)
+/* Lowering resolves every command into a timeline at absolute ticks, so encoding is a single pass over it */
+static void
+encode_events (void *user, const mml_timeline_event *events, size_t count)
 {
-    switch (cmd)
+    mml_context *ctx = user;
+
+    /* most events are notes of 2 to 4 bytes; reserving for that up front keeps the buffer from growing step by step */
+    da_reserve (ctx->arena, ctx->out, ctx->out->size + count * 4);
+
+    uint32_t tick = ctx->tick;
+    for (size_t i = 0; i < count; ++i)
     {
-    case 't':
-        ctx->tempo_us = 60000000 / arg;
-        write_tempo (ctx->mw, 0, ctx->tempo_us);
-        break;
-    case 'o': ctx->octave = arg; break;
-    case 'v': ctx->velocity = arg % 127; break;
-    case 'l': ctx->default_length = arg; break;
-    case '>': ctx->octave += 1; break;
-    case '<': ctx->octave -= 1; break;
-    default: abort ();
+        const mml_timeline_event *ev = &events[i];
+        uint32_t delta = ev->tick - tick;
+        tick = ev->tick;
+
+        switch (ev->kind)
+        {
+        case MML_TIMELINE_NOTE_ON: emit_note (ctx, delta, ev->note, ev->velocity); break;
+        case MML_TIMELINE_NOTE_OFF: emit_note (ctx, delta, ev->note, 0); break;
+        case MML_TIMELINE_TEMPO: write_tempo (ctx, delta, ev->value); break;
+        case MML_TIMELINE_END: write_end_of_track (ctx, delta); break;
+        }
     }
+    ctx->tick = tick;
 }
 
-typedef struct
+/* Tracks start from a fully reset state, so once the song is split at MML_EV_EOT each one can be encoded on its
+ * own thread, into its own buffer; the buffers are then written out in order. */
+
+#define TIMELINE_CHUNK 4096 /* events lowered at a time */
+
+/* below this many events, threads cost more than the encoding itself */
+#define PARALLEL_MIN_EVENTS 4096
+
+void
+mml_encode_track (const mml_song *song, size_t offset, uint8_t channel, mml_arena *arena, mml_track_bytes *out)
 {
-    uint8_t midi_note;
-    bool is_tied;
-} chord_note_t;
+    MML_SPAN_BEGIN (start);
+    mml_context ctx = {
+        .out = out,
+        .last_status = 0,
+        .channel = channel,
+        .arena = arena,
+        .tick = 0,
+    };
+    /* the timeline goes through one small buffer, which stays in cache, instead of being built whole */
+    mml_lower_track_chunked (song, offset, MML_SMF_PPQ, arena, TIMELINE_CHUNK, encode_events, &ctx);
+    MML_STAT_ADD (track_bytes[channel % MML_STATS_MAX_TRACKS], out->size);
+    MML_SPAN_END (start, "encode", channel);
+}
 
-uint32_t
-process_track (mml_context *ctx)
+typedef struct
 {
-    uint32_t last_tick = 0;
+    size_t begin; /* first event of the track in `mml_song.events` */
+    mml_arena arena; /* the bytes and the playback stacks */
+} track_job;
 
-    memset (ctx->active_notes, 0, sizeof (ctx->active_notes));
+typedef struct
+{
+    const mml_song *song;
+    track_job *tracks;
+    mml_track_bytes *bytes;
+    size_t ntracks;
+    atomic_size_t next; /* next track to encode */
+} encode_state;
+
+static void *
+encode_worker (void *arg)
+{
+    encode_state *state = arg;
 
     for (;;)
     {
-        if (ctx->offset >= ctx->events->size) break;
-
-        mml_event ev = ctx->events->items[ctx->offset];
-
-        if (ev.kind != MML_EV_NOTE)
-        {
-            ctx->offset++;
-            switch (ev.kind)
-            {
-            case MML_EV_EOT: return last_tick;
-            case MML_EV_CTL: process_control (ctx, ev.as.ctl.cmd, ev.as.ctl.value); break;
-            default: break;
-            }
-            continue;
-        }
-
-        chord_note_t batch[128];
-        int batch_count = 0;
-        uint32_t step_duration = 0;
-        bool step_complete = false;
-
-        while (!step_complete && ctx->offset < ctx->events->size)
-        {
-            mml_event *nev = &ctx->events->items[ctx->offset];
-            if (nev->kind != MML_EV_NOTE) break;
-
-            int note = pitch_to_midi_note (nev->as.note.pitch, ctx->octave, nev->as.note.acc);
-
-            if (note >= 0)
-            {
-                batch[batch_count].midi_note = (uint8_t)note;
-                batch[batch_count].is_tied = nev->as.note.tie;
-                batch_count++;
-            }
-
-            if (!nev->as.note.chord_link)
-            {
-                if (nev->as.note.length == 0) nev->as.note.length = ctx->default_length;
-                step_duration = calculate_duration (nev->as.note.length, nev->as.note.dots, ctx->ticks_per_quarter);
-                step_complete = true;
-            }
-            ctx->offset++;
-        }
-
-        uint32_t delta = ctx->current_tick - last_tick;
+        size_t i = atomic_fetch_add (&state->next, 1);
+        if (i >= state->ntracks) return NULL;
+        mml_encode_track (state->song, state->tracks[i].begin, i, &state->tracks[i].arena, &state->bytes[i]);
+    }
+}
 
-        for (int i = 0; i < batch_count; i++)
-        {
-            uint8_t note = batch[i].midi_note;
-            if (!ctx->active_notes[note])
-            {
-                midi_event_t mev = { .kind = MIDI_NOTE_ON,
-                                     .channel = ctx->channel,
-                                     .as.note_on = { .note = note, .velocity = ctx->velocity } };
-                write_midi (ctx, (i == 0) ? delta : 0, mev);
-                if (i == 0) delta = 0;
-                ctx->active_notes[note] = true;
-            }
-        }
+int
+mml_write_midi_fd (const mml_song *song, int fd, unsigned threads)
+{
+    if (!song || fd < 0) return -1;
 
-        if (batch_count > 0) { last_tick = ctx->current_tick; }
+    /* one track per `;`, and as many as there are channels */
+    track_job tracks[MML_SMF_MAX_TRACKS] = { 0 };
+    mml_track_bytes bytes[MML_SMF_MAX_TRACKS] = { 0 };
+    size_t ntracks = 0;
+    for (size_t offset = 0; offset < song->events.size && ntracks < MML_SMF_MAX_TRACKS;)
+    {
+        tracks[ntracks++].begin = offset;
+        while (offset < song->events.size && song->events.items[offset].kind != MML_EV_EOT) offset++;
+        offset++;
+    }
 
-        ctx->current_tick += step_duration;
+    if (threads == 0) threads = sysconf (_SC_NPROCESSORS_ONLN);
+    if (song->events.size + song->bodies.size < PARALLEL_MIN_EVENTS) threads = 1;
+    if (threads > ntracks) threads = ntracks;
 
-        bool first_off = true;
-        uint32_t off_delta = ctx->current_tick - last_tick;
+    encode_state state = { .song = song, .tracks = tracks, .bytes = bytes, .ntracks = ntracks };
+    pthread_t workers[MML_SMF_MAX_TRACKS];
+    unsigned started = 0;
+    while (started + 1 < threads && pthread_create (&workers[started], NULL, encode_worker, &state) == 0) started++;
+    encode_worker (&state);
+    for (unsigned i = 0; i < started; ++i) pthread_join (workers[i], NULL);
 
-        for (int i = 0; i < batch_count; i++)
-        {
-            uint8_t note = batch[i].midi_note;
-            bool is_tied = batch[i].is_tied;
-
-            if (!is_tied)
-            {
-                midi_event_t mev
-                    = { .kind = MIDI_NOTE_ON, .channel = ctx->channel, .as.note_on = { .note = note, .velocity = 0 } };
-
-                write_midi (ctx, first_off ? off_delta : 0, mev);
-                if (first_off)
-                {
-                    off_delta = 0;
-                    last_tick = ctx->current_tick;
-                    first_off = false;
-                }
-                ctx->active_notes[note] = false;
-            }
-        }
-    }
+    int result = mml_write_tracks_fd (fd, bytes, ntracks);
+    for (size_t i = 0; i < ntracks; ++i) mml_arena_free (&tracks[i].arena);
 
-    return last_tick;
+    return result;
 }
 
 int
-mml_write_midi (const mml_sequence *events, const char *out_path)
+mml_write_tracks_fd (int fd, const mml_track_bytes *tracks, size_t ntracks)
 {
-    if (!events || !out_path) return -1;
+    /* every chunk goes out whole, header and data in one writev, so the output never has to be seekable */
+    midi_writer_t mw = { 0 };
+    int result = mw_begin_fd (&mw, fd, MIDI_FMT_MTRACK, MML_SMF_PPQ, ntracks);
+    for (size_t i = 0; i < ntracks && result == 0; ++i) result = mw_track_chunk (&mw, tracks[i].items, tracks[i].size);
+    if (result == 0) result = mw_end (&mw);
 
-    FILE *file = fopen (out_path, "wb");
-    if (!file) return -1;
+    return result;
+}
 
+int
+mml_write_header_fd (int fd, size_t ntracks)
+{
     midi_writer_t mw = { 0 };
-    mml_context ctx = {
-        .mw = &mw,
-        .last_status = 0,
-        .events = events,
-        .offset = 0,
-        .ticks_per_quarter = 480,
-    };
-
-    mw_begin (&mw, file, MIDI_FMT_MTRACK, ctx.ticks_per_quarter);
+    return mw_begin_fd (&mw, fd, MIDI_FMT_MTRACK, MML_SMF_PPQ, ntracks);
+}
 
-    for (;;)
-    {
-        if (ctx.offset >= ctx.events->size) break;
+int
+mml_write_track_fd (int fd, const mml_track_bytes *track)
+{
+    return mw_track_chunk_fd (fd, track->items, track->size);
+}
 
-        ctx.current_tick = 0;
-        ctx.default_length = 4;
-        ctx.tempo_us = 500000;
-        ctx.octave = 4;
-        ctx.velocity = 100;
-        ctx.last_status = 0;
+int
+mml_write_ntracks_fd (int fd, uint64_t header, size_t ntracks)
+{
+    /* MThd, its length, then the format: the count is the 16-bit word at offset 10 */
+    const uint8_t count[2] = { ntracks >> 8, ntracks };
+    return pwrite (fd, count, sizeof count, header + 10) == sizeof count ? 0 : -1;
+}
 
-        mw_track_begin (&mw);
-        write_tempo (&mw, 0, ctx.tempo_us);
+int
+mml_write_midi (const mml_song *song, const char *out_path, unsigned threads)
+{
+    if (!song || !out_path) return -1;
+    if (strcmp (out_path, "-") == 0) return mml_write_midi_fd (song, STDOUT_FILENO, threads);
 
-        uint32_t t = process_track (&ctx);
+    int fd = open (out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) return -1;
 
-        write_end_of_track (&mw, t);
-        mw_track_end (&mw);
+    int result = mml_write_midi_fd (song, fd, threads);
+    if (close (fd) != 0) result = -1;
 
-        ctx.channel += 1;
-        if (ctx.channel >= 16) break;
-    }
-    mw_end (&mw);
-    fclose (file);
-    return 0;
+    return result;
 }
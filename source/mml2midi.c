@@ -4,47 +4,187 @@
 #include "mml2midi.h"
 
 #include <stdio.h>
+#include <string.h>
 
-int
-main (int argc, char *argv[])
+static void
+print_events (const mml_song *song)
 {
-    if (argc < 3) return 1;
-
-    char *source = mml_read_all (argv[1]);
-    if (!source) return 2;
-    token *tokens = mml_tokenize (source, 0);
-    if (!tokens) return 3;
-    // token *t = tokens;
-
-    // while (t->kind != MML_EOF)
-    // {
-    //     printf ("[%.*s]\n", (int)t->view.size, t->view.data);
-    //     t++;
-    // }
+    printf ("sequence.len: %zu\n", song->events.size);
 
-    mml_sequence sequence = { 0 };
-    mml_parse (tokens, &sequence);
-    printf ("sequence.len: %zu\n", sequence.size);
-
-    for (size_t i = 0; i < sequence.size; ++i)
+    for (size_t i = 0; i < song->events.size; ++i)
     {
-        mml_event ev = sequence.items[i];
+        mml_event ev = song->events.items[i];
         switch (ev.kind)
         {
         case MML_EV_NOTE:
-            printf ("NOTE %c {", ev.as.note.pitch);
-            printf ("%d %d %d", ev.as.note.length, ev.as.note.acc, ev.as.note.dots);
+            printf ("NOTE %c {", ev.note.pitch);
+            printf ("%d %d %d", ev.note.length, ev.note.acc, ev.note.dots);
             printf ("};\n");
             break;
-        case MML_EV_CTL: printf ("CTL %c {%d}\n", ev.as.ctl.cmd, ev.as.ctl.value); break;
+        case MML_EV_CTL: printf ("CTL %c {%d}\n", ev.ctl.cmd, ev.ctl.value); break;
         case MML_EV_EOT: printf ("END OF TRACK\n"); break;
+        case MML_EV_EXPAND: printf ("EXPAND {%u}\n", ev.expand.body); break;
+        case MML_EV_RET: printf ("RET\n"); break;
+        case MML_EV_LOOP: printf ("LOOP {%u %u}\n", ev.loop.count, ev.loop.skip); break;
+        case MML_EV_BREAK: printf ("BREAK {%u}\n", ev.loop.skip); break;
+        case MML_EV_LOOP_END: printf ("LOOP END\n"); break;
         }
     }
+}
 
-    mml_write_midi (&sequence, argv[2]);
+static void
+usage (void)
+{
+    fprintf (stderr, "usage: mml2midi [--stats] [--trace out.json] [--cache dir [--cache-max MiB]] in.mml out.mid\n"
+                     "       mml2midi --batch <manifest|dir> [-j N] [-o outdir] [--compare] [--cache dir]\n"
+                     "       mml2midi --watch input.mml output.mid\n"
+                     "       mml2midi --play <fifo|unix-socket> input.mml\n"
+                     "       mml2midi --stream [--tracks N] < input.mml > output.mid\n"
+                     "       mml2midi --inspect [-q] [--strict] [-j workers] file.mid...\n");
+}
 
-    free (tokens);
-    free (source);
+static int
+report (bool stats, const char *trace_path, const mml_cache *cache)
+{
+#if MML_STATS
+    /* on stderr, stdout may be carrying the MIDI data */
+    if (stats) mml_stats_print (stderr);
+    if (stats && cache) mml_cache_print (cache, stderr);
+    if (trace_path && mml_stats_write_trace (trace_path) != 0)
+    {
+        perror ("mml: Failed to write trace");
+        return 5;
+    }
+#else
+    (void)stats, (void)trace_path, (void)cache;
+#endif
 
     return 0;
 }
+
+/* A hit is copied without parsing anything, so there are no events to print */
+static int
+compile_cached (mml_source *source, const char *in_path, const char *out_path, const char *dir, size_t max_mib,
+                bool stats, const char *trace_path)
+{
+    mml_cache cache;
+    if (mml_cache_open (&cache, dir, max_mib << 20) != 0)
+    {
+        perror ("mml: Failed to open cache");
+        mml_source_close (source);
+        return 2;
+    }
+
+    mml_song song = { 0 };
+    mml_split split = { 0 };
+    MML_SPAN_BEGIN (compile_start);
+    int errors = mml_cache_compile (&cache, source, in_path, out_path, &song, &split);
+    MML_SPAN_END (compile_start, "compile", -1);
+    if (errors < 0) perror ("mml: Failed to write output");
+    if (errors > 0) fprintf (stderr, "%s: %d error%s\n", in_path, errors, errors == 1 ? "" : "s");
+
+    mml_cache_close (&cache);
+    mml_split_free (&split);
+    mml_song_free (&song);
+    mml_source_close (source);
+
+    if (errors != 0) return errors < 0 ? 5 : 4;
+    return report (stats, trace_path, &cache);
+}
+
+int
+main (int argc, char *argv[])
+{
+    const char *name = strrchr (argv[0], '/');
+    if (strcmp (name ? name + 1 : argv[0], "smfcheck") == 0) return mml_inspect_main (argc, argv);
+
+    if (argc > 1 && strcmp (argv[1], "--batch") == 0) return mml_batch_main (argc - 1, argv + 1);
+    if (argc > 1 && strcmp (argv[1], "--watch") == 0) return mml_watch_main (argc - 1, argv + 1);
+    if (argc > 1 && strcmp (argv[1], "--play") == 0) return mml_play_main (argc - 1, argv + 1);
+    if (argc > 1 && strcmp (argv[1], "--stream") == 0) return mml_stream_main (argc - 1, argv + 1);
+    if (argc > 1 && strcmp (argv[1], "--inspect") == 0) return mml_inspect_main (argc - 1, argv + 1);
+
+    bool stats = false;
+    const char *trace_path = NULL, *cache_dir = NULL;
+    size_t cache_max = MML_CACHE_MAX_MIB;
+    int arg = 1;
+    for (; arg < argc && strncmp (argv[arg], "--", 2) == 0; ++arg)
+    {
+        if (strcmp (argv[arg], "--stats") == 0)
+            stats = true;
+        else if (strcmp (argv[arg], "--trace") == 0 && arg + 1 < argc)
+            trace_path = argv[++arg];
+        else if (strcmp (argv[arg], "--cache") == 0 && arg + 1 < argc)
+            cache_dir = argv[++arg];
+        else if (strcmp (argv[arg], "--cache-max") == 0 && arg + 1 < argc)
+            cache_max = strtoul (argv[++arg], NULL, 10);
+        else
+        {
+            usage ();
+            return 1;
+        }
+    }
+    if (argc - arg < 2)
+    {
+        usage ();
+        return 1;
+    }
+    const char *in_path = argv[arg], *out_path = argv[arg + 1];
+
+#if MML_STATS
+    mml_stats.enabled = stats || trace_path;
+#else
+    if (stats || trace_path)
+    {
+        fprintf (stderr, "mml: --stats and --trace are not available, this build has MML_STATS=0\n");
+        return 1;
+    }
+#endif
+
+    MML_SPAN_BEGIN (read_start);
+    mml_source source;
+    if (mml_source_open (&source, in_path, 0) != 0) return 2;
+    MML_STAT_ADD (bytes_read, source.size);
+    MML_SPAN_END (read_start, "read", -1);
+
+    if (cache_dir) return compile_cached (&source, in_path, out_path, cache_dir, cache_max, stats, trace_path);
+
+    MML_SPAN_BEGIN (parse_start);
+    mml_lexer lexer;
+    if (mml_lexer_init (&lexer, source.data, source.size) != 0) return 3;
+
+    // for (token t = mml_read_next_token (&lexer); t.kind != MML_EOF; t = mml_read_next_token (&lexer))
+    //     printf ("[%.*s]\n", (int)t.length, source.data + t.offset);
+
+    mml_song song = { 0 };
+    int errors = mml_parse (&lexer, &song);
+    MML_STAT_ADD (events_parsed, song.events.size + song.bodies.size);
+    MML_SPAN_END (parse_start, "parse", -1);
+
+    mml_diagnostics_print (stderr, in_path, source.data, source.size, &song.diagnostics);
+    if (errors > 0)
+    {
+        fprintf (stderr, "%s: %d error%s\n", in_path, errors, errors == 1 ? "" : "s");
+        mml_song_free (&song);
+        mml_source_close (&source);
+        return 4;
+    }
+
+    /* with "-" as the output, stdout carries the MIDI data */
+    if (strcmp (out_path, "-") != 0) print_events (&song);
+
+    MML_SPAN_BEGIN (write_start);
+    if (mml_write_midi (&song, out_path, 0) != 0)
+    {
+        perror ("mml: Failed to write output");
+        mml_song_free (&song);
+        mml_source_close (&source);
+        return 5;
+    }
+    MML_SPAN_END (write_start, "write", -1);
+
+    mml_song_free (&song);
+    mml_source_close (&source);
+
+    return report (stats, trace_path, NULL);
+}
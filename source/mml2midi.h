@@ -4,35 +4,118 @@
 #ifndef MML2MIDI_H
 #define MML2MIDI_H
 
+#include <assert.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <uchar.h>
 
+/* Bump allocator for everything a compilation produces. Allocations are never freed one by one: the whole arena
+ * is released at once by `mml_arena_reset` or `mml_arena_free`. A NULL arena allocates from the heap instead. */
+typedef struct mml_arena_block mml_arena_block;
+
+typedef struct
+{
+    mml_arena_block *head;
+    size_t blocks;   /* blocks taken from malloc over the arena's lifetime */
+    size_t reserved; /* bytes held right now */
+} mml_arena;
+
+#define MML_ARENA_BLOCK ((size_t)64 << 10)     /* size of the first block; each next one doubles */
+#define MML_ARENA_BLOCK_MAX ((size_t)64 << 20) /* blocks stop doubling here */
+
+void *mml_arena_alloc (mml_arena *arena, size_t size);
+void *mml_arena_realloc (mml_arena *arena, void *ptr, size_t old_size, size_t new_size);
+void mml_arena_reset (mml_arena *arena); /* drops every allocation, keeps the largest block for reuse */
+void mml_arena_free (mml_arena *arena);
+
+/* Counters and timed spans behind `--stats` and `--trace`. They only record anything once `mml_stats.enabled` is
+ * set; build with -DMML_STATS=0 and every MML_STAT and MML_SPAN macro compiles to nothing. */
+#ifndef MML_STATS
+#define MML_STATS 1
+#endif
+
+#define MML_STATS_MAX_TRACKS 16
+#define MML_STATS_MAX_SPANS 256
+
+#if MML_STATS
+typedef struct
+{
+    const char *name;
+    int track;                     /* -1 for the stages of the pipeline */
+    int tid;                       /* thread that ran the span */
+    uint64_t start_ns, end_ns;     /* CLOCK_MONOTONIC */
+    size_t reallocs, bytes_copied; /* counter values when the span ended */
+    long rss_kb;                   /* peak RSS when the span ended */
+} mml_span;
+
+typedef struct
+{
+    bool enabled;
+
+    atomic_size_t bytes_read;
+    atomic_size_t tokens;
+    atomic_size_t events_parsed;   /* events and macro bodies as parsed */
+    atomic_size_t events_expanded; /* note, control and end-of-track events played through macros and loops */
+    atomic_size_t bytes_copied;    /* by `da_append_many` */
+    atomic_size_t reallocs;        /* growths of dynamic arrays and buffers */
+    atomic_size_t track_bytes[MML_STATS_MAX_TRACKS]; /* SMF track data, without the chunk header */
+
+    atomic_size_t nspans;
+    mml_span spans[MML_STATS_MAX_SPANS];
+} mml_stats_t;
+
+extern mml_stats_t mml_stats;
+
+uint64_t mml_stats_now (void);
+void mml_stats_span (const char *name, int track, uint64_t start_ns);
+void mml_stats_print (FILE *out);
+int mml_stats_write_trace (const char *path); /* Chrome trace-event JSON, for chrome://tracing or Perfetto */
+
+#define MML_STAT_ADD(counter, n)                                                                                       \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (mml_stats.enabled) atomic_fetch_add_explicit (&mml_stats.counter, (n), memory_order_relaxed);              \
+    } while (0)
+#define MML_SPAN_BEGIN(var) uint64_t var = mml_stats.enabled ? mml_stats_now () : 0
+#define MML_SPAN_END(var, name, track) mml_stats_span ((name), (track), (var))
+#else
+#define MML_STAT_ADD(counter, n) ((void)0)
+#define MML_SPAN_BEGIN(var)
+#define MML_SPAN_END(var, name, track) ((void)0)
+#endif
+
 #define DA_INIT_CAPACITY 32
 
-#define da_reserve(da, new_cap)                                                                                        \
+#define da_reserve(arena, da, new_cap)                                                                                 \
     do                                                                                                                 \
     {                                                                                                                  \
         if ((new_cap) > (da)->capacity)                                                                                \
         {                                                                                                              \
+            size_t _old_cap = (da)->capacity;                                                                          \
+            MML_STAT_ADD (reallocs, 1);                                                                                \
             if ((da)->capacity == 0) (da)->capacity = DA_INIT_CAPACITY;                                                \
             while ((new_cap) > (da)->capacity) (da)->capacity *= 2;                                                    \
-            (da)->items = realloc ((da)->items, (da)->capacity * sizeof (*(da)->items));                               \
+            (da)->items = mml_arena_realloc ((arena), (da)->items, _old_cap * sizeof (*(da)->items),                   \
+                                             (da)->capacity * sizeof (*(da)->items));                                  \
         }                                                                                                              \
     } while (0)
 
-#define da_append(da, item)                                                                                            \
+#define da_append(arena, da, item)                                                                                     \
     do                                                                                                                 \
     {                                                                                                                  \
-        da_reserve ((da), (da)->size + 1);                                                                             \
+        da_reserve ((arena), (da), (da)->size + 1);                                                                    \
         (da)->items[(da)->size++] = (item);                                                                            \
     } while (0)
 
-#define da_append_many(da, new_items, count)                                                                           \
+#define da_append_many(arena, da, new_items, count)                                                                    \
     do                                                                                                                 \
     {                                                                                                                  \
-        da_reserve ((da), (da)->size + (count));                                                                       \
+        da_reserve ((arena), (da), (da)->size + (count));                                                              \
+        MML_STAT_ADD (bytes_copied, (count) * sizeof (*(da)->items));                                                  \
         memcpy ((da)->items + (da)->size, (new_items), (count) * sizeof (*(da)->items));                               \
         (da)->size += (count);                                                                                         \
     } while (0)
@@ -66,52 +149,334 @@ typedef enum
     MML_EOF,
 } token_kind;
 
+/* Tokens refer to the source by 32-bit offset and length; numbers are decoded by the lexer. */
 typedef struct
 {
-    token_kind kind;
-    string_view view;
+    uint8_t kind;    /* token_kind */
+    uint32_t offset; /* into the lexer source */
+    uint32_t length;
+    uint32_t value; /* MML_NUMBER only */
 } token;
 
+#define MML_NUMBER_OVERFLOW UINT32_MAX /* value of numbers that do not fit in 32 bits */
+
+/* The whole token stream of a source, as parallel arrays. */
+typedef struct
+{
+    uint8_t *kinds;
+    uint32_t *offsets;
+    uint32_t *lengths;
+    uint32_t *values;
+    size_t size, capacity;
+} mml_token_stream;
+
+#define MML_CC_SPACE (1u << 0)
+#define MML_CC_NEWLINE (1u << 1)
+#define MML_CC_DIGIT (1u << 2)
+#define MML_CC_IDENT (1u << 3)   /* may continue an identifier after '@' or '!' */
+#define MML_CC_COMMENT (1u << 4) /* starts a comment */
+
+typedef struct
+{
+    unsigned char kind;  /* token_kind started by this byte */
+    unsigned char flags; /* MML_CC_* */
+} mml_char_class;
+
+extern const mml_char_class mml_char_table[256];
+
+/* Incremental lexer state; tokens are pulled one at a time with `mml_read_next_token`.
+ * Once the end of input is reached, every further call returns MML_EOF. */
+typedef struct
+{
+    const char *data;
+    size_t offset, size;
+} mml_lexer;
+
 typedef enum
 {
     MML_EV_NOTE,
     MML_EV_CTL,
     MML_EV_EOT,
+    MML_EV_EXPAND,   /* play the macro body at `as.expand.body` */
+    MML_EV_RET,      /* end of a macro body */
+    MML_EV_LOOP,     /* play what follows up to the matching MML_EV_LOOP_END `as.loop.count` times */
+    MML_EV_BREAK,    /* ':' - leave the loop here on its last pass */
+    MML_EV_LOOP_END, /* end of the loop body */
 } mml_event_kind;
 
-typedef struct
+/* Eight bytes per event, so that the writer streams through as few cache lines as possible. Every variant starts
+ * with the same `kind` bit-field, which is also reachable directly as `ev.kind`; build events through the variant
+ * that matches the kind, e.g. `(mml_event){ .note = { .kind = MML_EV_NOTE, ... } }`. */
+typedef union
 {
-    mml_event_kind kind;
-
-    union
+    struct
+    {
+        uint32_t kind : 4; /* mml_event_kind */
+    };
+    struct
+    {
+        uint32_t kind : 4;
+        uint32_t pitch : 8; /* ASCII note letter */
+        int32_t acc : 2;    /* +1 = sharp; -1 = flat */
+        uint32_t tie : 1;
+        uint32_t chord_link : 1;
+        uint32_t dots : 16; /* n. of dots, saturated at MML_DOTS_MAX */
+        uint32_t length;    /* 0 = default */
+    } note;
+    struct
     {
-        struct
-        {
-            char32_t pitch;
-            unsigned length; // 0 = default
-            unsigned dots;   // n. of dots
-            int acc;         // +1 = sharp; -1 = flat
-
-            bool tie;
-            bool chord_link;
-        } note;
-        struct
-        {
-            char32_t cmd;
-            unsigned value; // 0 = not specified
-        } ctl;
-    } as;
+        uint32_t kind : 4;
+        uint32_t cmd : 8; /* ASCII command letter */
+        uint32_t value;   /* 0 = not specified */
+    } ctl;
+    struct
+    {
+        uint32_t kind : 4;
+        uint32_t body; /* offset into `mml_song.bodies` */
+    } expand;
+    struct
+    {
+        uint32_t kind : 4;
+        uint32_t count : 28; /* passes, at most MML_LOOP_COUNT_MAX; 0 skips the loop */
+        uint32_t skip;       /* distance to the matching MML_EV_LOOP_END */
+    } loop;
 } mml_event;
 
+static_assert (sizeof (mml_event) == 8, "mml_event must stay packed into 8 bytes");
+
+#define MML_DOTS_MAX 0xFFFFu /* more dots than this add nothing to a 32-bit duration anyway */
+#define MML_LOOP_COUNT_MAX 0xFFFFFFFu
+
 typedef struct
 {
     mml_event *items;
     size_t size, capacity;
 } mml_sequence;
 
+typedef enum
+{
+    MML_SEVERITY_ERROR,
+    MML_SEVERITY_WARNING,
+} mml_severity;
+
+/* A problem found in the source. Only the byte span is kept; line and column are computed on demand, with
+ * `mml_source_position`. */
+typedef struct
+{
+    mml_severity severity;
+    uint32_t offset, length; /* into the lexer source */
+    const char *message;     /* NUL-terminated */
+} mml_diagnostic;
+
+typedef struct
+{
+    mml_diagnostic *items;
+    size_t size, capacity;
+    size_t errors; /* diagnostics with MML_SEVERITY_ERROR */
+} mml_diagnostics;
+
+/* Neither macros nor loops are expanded by the parser: every `@name` becomes one MML_EV_EXPAND event, which refers
+ * to the single copy of the body in `bodies`, and every loop body is stored once between MML_EV_LOOP and
+ * MML_EV_LOOP_END. */
+typedef struct
+{
+    mml_sequence events; /* tracks, each terminated by MML_EV_EOT */
+    mml_sequence bodies; /* macro bodies, each terminated by MML_EV_RET */
+    mml_diagnostics diagnostics;
+
+    mml_arena arena; /* backs the sequences, the diagnostics and all of the parser's working memory */
+} mml_song;
+
+typedef struct mml_macro_table mml_macro_table;
+
+/* The macros of a source that is parsed a piece at a time, with `mml_parse_piece`: every piece can expand the ones
+ * the pieces before it defined. Zero-initialized, it holds none. */
+typedef struct
+{
+    mml_sequence bodies;    /* as `mml_song.bodies` */
+    mml_macro_table *table; /* names to bodies */
+    mml_arena arena;        /* backs both */
+} mml_macros;
+
+typedef enum
+{
+    MML_TIMELINE_NOTE_ON,
+    MML_TIMELINE_NOTE_OFF,
+    MML_TIMELINE_TEMPO,
+    MML_TIMELINE_END, /* end of track */
+} mml_timeline_kind;
+
+typedef struct
+{
+    uint32_t tick;    /* absolute */
+    uint32_t value;   /* NOTE_ON: ticks until its NOTE_OFF, UINT32_MAX if never released; TEMPO: microseconds/quarter */
+    uint8_t kind;     /* mml_timeline_kind */
+    uint8_t note;
+    uint8_t velocity; /* NOTE_ON only */
+} mml_timeline_event;
+
+/* One track with every command applied and every macro and loop played: MIDI events in the order and at the ticks
+ * at which they land in the SMF. */
+typedef struct
+{
+    mml_timeline_event *items;
+    size_t size, capacity;
+} mml_timeline;
+
+/* Read-only view of an MML source. Regular files are mapped, everything else (stdin, pipes, FIFOs) is read into
+ * a growing heap buffer. `data` is NOT NUL-terminated, always pass `size` along. */
+typedef struct
+{
+    const char *data;
+    size_t size;
+
+    void *base;
+    bool mapped;
+} mml_source;
+
+#define MML_SOURCE_HUGEPAGES (1u << 0) /* hint the kernel to back the input with huge pages */
+#define MML_SOURCE_NOMAP (1u << 1)     /* never mmap, always use the streaming reader */
+
+uint64_t mml_hash64 (const void *data, size_t length, uint64_t seed);
+
 char *mml_read_all (const char *path);
-token *mml_tokenize (const char *source, size_t length);
-int mml_parse (const token *tokens, mml_sequence *out_sequence);
-int mml_write_midi (const mml_sequence *events, const char *out_path);
+int mml_source_open (mml_source *src, const char *path, unsigned flags); /* path NULL or "-" reads stdin */
+void mml_source_close (mml_source *src);
+/* Byte-run scanners used by the lexer. Each returns the offset of the first byte at or after `offset` that ends
+ * the run, or `size`. Implementations are picked at runtime from the CPU features, on first use or through
+ * `mml_scan_select`, which returns -1 if the requested implementation is not available. */
+typedef size_t (*mml_scan_fn) (const char *data, size_t offset, size_t size);
+
+typedef enum
+{
+    MML_SCAN_AUTO,
+    MML_SCAN_SCALAR,
+    MML_SCAN_SSE2,
+    MML_SCAN_AVX2,
+} mml_scan_impl;
+
+extern mml_scan_fn mml_scan_space;   /* first byte that is not whitespace */
+extern mml_scan_fn mml_scan_newline; /* first '\r' or '\n' */
+extern mml_scan_fn mml_scan_digits;  /* first byte that is not a decimal digit */
+extern mml_scan_fn mml_scan_ident;   /* first byte that cannot continue an identifier */
+
+int mml_scan_select (mml_scan_impl impl);
+const char *mml_scan_name (void);
+
+int mml_lexer_init (mml_lexer *lexer, const char *source, size_t length); /* sources are limited to 4 GiB */
+token mml_read_next_token (mml_lexer *lexer);
+int mml_tokenize (const char *source, size_t length, mml_token_stream *out_stream);
+void mml_token_stream_free (mml_token_stream *stream);
+/* Returns the number of errors, all of them recorded in `out_song->diagnostics`; the song is only complete when
+ * that is 0. Returns -1 with errno set on invalid arguments or empty input. */
+int mml_parse (mml_lexer *lexer, mml_song *out_song);
+/* Parses the next piece of a source, any number of whole `;`-terminated tracks, like `mml_parse` parses the source:
+ * the events and diagnostics are the ones a parse of the whole source gives the piece, with offsets into the piece.
+ * The macros it defines are added to `macros`, and `out_song->bodies` is set to theirs, which `macros` keeps owning. */
+int mml_parse_piece (mml_lexer *lexer, mml_song *out_song, mml_macros *macros);
+void mml_macros_free (mml_macros *macros);
+void mml_source_position (const char *data, size_t size, size_t offset, unsigned *line, unsigned *column);
+void mml_diagnostics_print (FILE *out, const char *path, const char *data, size_t size,
+                            const mml_diagnostics *diagnostics); /* as `path:line:column: severity: message` */
+void mml_song_reset (mml_song *song); /* empties the song for the next compilation, keeping its memory */
+void mml_song_free (mml_song *song);
+/* Lowers the track that starts at `offset` in `song->events`, appending to `out`, allocated from `arena` (NULL = heap).
+ * The song is only read, so any number of tracks can be lowered at once, from any number of threads. */
+void mml_lower_track (const mml_song *song, size_t offset, uint32_t ticks_per_quarter, mml_arena *arena,
+                      mml_timeline *out);
+/* Same, but the events are handed to `sink` `chunk` at a time, through one buffer that stays in cache. A NOTE_ON that
+ * leaves before its NOTE_OFF is lowered keeps UINT32_MAX as its duration. */
+typedef void (*mml_timeline_sink) (void *user, const mml_timeline_event *events, size_t count);
+void mml_lower_track_chunked (const mml_song *song, size_t offset, uint32_t ticks_per_quarter, mml_arena *arena,
+                              size_t chunk, mml_timeline_sink sink, void *user);
+/* What the writer produces: a format 1 SMF, and as many tracks as there are channels */
+#define MML_SMF_FORMAT 1
+#define MML_SMF_PPQ 480
+#define MML_SMF_MAX_TRACKS 16
+
+/* Encoded data of one SMF track, without the MTrk chunk header */
+typedef struct
+{
+    uint8_t *items;
+    size_t size, capacity;
+} mml_track_bytes;
+
+/* Encodes the track that starts at `offset` in `song->events` on `channel`, appending to `out`, allocated from `arena`
+ * (NULL = heap). `mml_write_tracks_fd` writes tracks encoded this way, in order, as a format 1 SMF. */
+void mml_encode_track (const mml_song *song, size_t offset, uint8_t channel, mml_arena *arena, mml_track_bytes *out);
+int mml_write_tracks_fd (int fd, const mml_track_bytes *tracks, size_t ntracks);
+/* For tracks written as they are encoded: the header declares `ntracks` up front, or, when `fd` can seek, declares 0
+ * and has the count patched in once every track is out, `header` being the offset the header was written at */
+int mml_write_header_fd (int fd, size_t ntracks);
+int mml_write_track_fd (int fd, const mml_track_bytes *track);
+int mml_write_ntracks_fd (int fd, uint64_t header, size_t ntracks);
+/* Writes a format 1 SMF. Output is never seeked, so `out_path` "-" (stdout) and pipes work; threads 0 = one per CPU */
+int mml_write_midi (const mml_song *song, const char *out_path, unsigned threads);
+int mml_write_midi_fd (const mml_song *song, int fd, unsigned threads);
+uint64_t mml_track_ticks (const mml_song *song, size_t offset, uint32_t ticks_per_quarter); /* offset into events */
+
+/* A source cut into its `;`-separated tracks, for compiling them one at a time. Each track is fingerprinted by its
+ * span, its index (which is its channel) and every macro definition it can reach, directly or through other macros:
+ * two tracks with the same fingerprint parse to the same events and diagnostics when parsed alone. */
+typedef struct
+{
+    uint32_t begin, end;  /* after the previous `;`, up to and including its own */
+    uint64_t fingerprint;
+    uint32_t deps, ndeps; /* definitions it depends on, in the split's index */
+} mml_split_track;
+
+typedef struct mml_split_index mml_split_index;
+
+typedef struct
+{
+    const char *data; /* the source, which must outlive the split */
+    size_t size;
+    mml_split_track *tracks;
+    size_t ntracks;
+
+    mml_split_index *index; /* definitions and the names they use; kept for the next split */
+} mml_split;
+
+/* Returns -1 when a definition does not end where the split expects it: the source has errors, and has to be parsed
+ * whole for them to be reported. */
+int mml_split_source (mml_split *split, const char *data, size_t size);
+/* Parses one track alone into `song`, which is reset first, with diagnostic offsets into the whole source. Without
+ * diagnostics, the events are those of the track in a parse of the whole source; with any, that parse has to be run
+ * for the diagnostics to be the ones it reports. Returns like `mml_parse`. */
+int mml_split_parse (mml_split *split, size_t track, mml_song *song);
+void mml_split_free (mml_split *split);
+
+/* On-disk cache of compiled outputs, safe to share between processes. A whole SMF is found by the hash of its
+ * source, without parsing anything; when the source changed, every track that did not is found by its fingerprint. */
+typedef struct
+{
+    const char *dir;
+    size_t max_bytes; /* `mml_cache_close` evicts down to this; 0 = no limit */
+
+    atomic_size_t hits, misses;             /* whole files */
+    atomic_size_t track_hits, track_misses; /* tracks of the files that missed */
+    atomic_size_t evicted;
+} mml_cache;
+
+#define MML_CACHE_MAX_MIB 1024 /* default size limit of a cache directory */
+
+int mml_cache_open (mml_cache *cache, const char *dir, size_t max_bytes);
+/* Compiles `source` to `out_path` ("-" = stdout) through the cache, printing its diagnostics. `song` and `split` are
+ * working memory, kept for the next file. Returns the number of errors, or -1 if the output cannot be written. */
+int mml_cache_compile (mml_cache *cache, const mml_source *source, const char *in_path, const char *out_path,
+                       mml_song *song, mml_split *split);
+int mml_cache_close (mml_cache *cache);
+void mml_cache_print (const mml_cache *cache, FILE *out);
+
+/* `mml2midi --batch ...`; argv[0] is "--batch" */
+int mml_batch_main (int argc, char *argv[]);
+/* `mml2midi --watch ...`; argv[0] is "--watch" */
+int mml_watch_main (int argc, char *argv[]);
+/* `mml2midi --play ...`; argv[0] is "--play" */
+int mml_play_main (int argc, char *argv[]);
+/* `mml2midi --stream ...`; argv[0] is "--stream" */
+int mml_stream_main (int argc, char *argv[]);
+/* `mml2midi --inspect ...`, also run as `smfcheck ...`; argv[0] is either */
+int mml_inspect_main (int argc, char *argv[]);
 
 #endif